@@ -0,0 +1,312 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// timerbench compares the stores the event loop can keep its timers in, at
+// 10k, 100k and 1M timers, and prints one JSON line per store and count:
+//
+//   start   ev_timer_start of every timer, 1 to 60 s out
+//   again   ev_timer_again of every timer, as an idle timeout is restarted
+//   stop    ev_timer_stop of every timer
+//   expire  the loop's CPU time per timer while they all expire, 0.1 to
+//           0.6 s out, and how late the latest one was invoked
+//   reify   making them all pending at once, 1 to 60 s out, after moving
+//           the loop's clock a minute ahead
+//
+// Then, for each way the epoll backend can time its waits, it runs one
+// timer after another, 50 us to 5 ms out, on an otherwise idle loop, and
+// prints the distribution of how late they were invoked, measured on the
+// loop's own monotonic clock, and the CPU time per timer:
+//
+//   pwait2   epoll_pwait2 with a timespec, when the kernel has it
+//   timerfd  a timerfd in the epoll set, the fallback without it
+//   ms       epoll_wait alone, in whole milliseconds
+//
+// Times are nanoseconds per timer, the fastest of -r runs. The heap is the
+// layout ev.c was built with, "heap-soa" by default and "heap" with
+// -DEV_HEAP_SOA=0, which make bench builds as bench/timerbench-aos. The
+// time base is "ns" in bench/timerbench-ns, built with -DEV_TIME_NS=1.
+
+#define _GNU_SOURCE
+#define EV_STANDALONE 1
+#include "ev.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+typedef struct
+{
+    const char *name;
+    unsigned int flags;
+} store_t;
+
+static const store_t stores[] =
+{
+#if EV_HEAP_SOA
+    { "heap-soa", 0 },
+#else
+    { "heap", 0 },
+#endif
+    { "wheel", EVFLAG_TIMERWHEEL },
+};
+#define STORES (int)( sizeof( stores ) / sizeof( stores[0] ) )
+
+#if EV_TIME_NS
+static const char time_base[] = "ns";
+#else
+static const char time_base[] = "double";
+#endif
+
+static const char *const wakeups[] = { "pwait2", "timerfd", "ms" };
+#define WAKEUPS (int)( sizeof( wakeups ) / sizeof( wakeups[0] ) )
+#define WAKEUP_TIMERS 1000
+
+static const int counts[] = { 10000, 100000, 1000000 };
+#define COUNTS (int)( sizeof( counts ) / sizeof( counts[0] ) )
+
+typedef struct
+{
+    double start, again, stop, expire, late, reify;
+} result_t;
+
+static ev_timer *timers;
+static double *due;
+static int fired;
+static double late;
+static double lateness[ WAKEUP_TIMERS ];
+static unsigned int wakeup_seed;
+static ev_ltime deadline;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu()
+{
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+// The same pseudo random delays for every store
+static double delay(unsigned int *seed, double min, double max)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return min + ( max - min ) * ( ( *seed >> 8 ) & 0xffffff ) / (double)0x1000000;
+}
+
+static void timer_callback(EV_P_ ev_timer *w, int revents)
+{
+    double by = ev_now( loop ) - due[ w - timers ];
+    if ( by > late )
+        late = by;
+    ++fired;
+}
+
+static void run(const store_t *store, int count, result_t *r)
+{
+    struct ev_loop *loop = ev_loop_new( EVFLAG_AUTO | store->flags );
+    unsigned int seed = 1;
+    double start;
+    int i;
+
+    for ( i = 0 ; i < count ; ++i )
+        ev_timer_init( &timers[i], timer_callback, delay( &seed, 1, 60 ), 30 );
+
+    start = now();
+    for ( i = 0 ; i < count ; ++i )
+        ev_timer_start( loop, &timers[i] );
+    r->start = ( now() - start ) / count * 1e9;
+
+    start = now();
+    for ( i = 0 ; i < count ; ++i )
+        ev_timer_again( loop, &timers[i] );
+    r->again = ( now() - start ) / count * 1e9;
+
+    start = now();
+    for ( i = 0 ; i < count ; ++i )
+        ev_timer_stop( loop, &timers[i] );
+    r->stop = ( now() - start ) / count * 1e9;
+
+    ev_now_update( loop );
+    for ( i = 0 ; i < count ; ++i )
+    {
+        double after = delay( &seed, 0.1, 0.6 );
+        ev_timer_init( &timers[i], timer_callback, after, 0 );
+        ev_timer_start( loop, &timers[i] );
+        due[i] = ev_now( loop ) + after;
+    }
+    fired = 0;
+    late = 0;
+    start = cpu();
+    ev_run( loop, 0 );
+    r->expire = ( cpu() - start ) / count * 1e9;
+    r->late = late * 1e3;
+    if ( fired != count )
+        fprintf( stderr, "%s: %d of %d timers fired\n", store->name, fired, count );
+
+    for ( i = 0 ; i < count ; ++i )
+    {
+        ev_timer_init( &timers[i], timer_callback, delay( &seed, 1, 60 ), 0 );
+        ev_timer_start( loop, &timers[i] );
+    }
+    loop->mn_now += EV_LT( 61 );
+    start = now();
+    timers_reify( loop );
+    wheel_reify( loop );
+    r->reify = ( now() - start ) / count * 1e9;
+
+    ev_loop_destroy( loop );
+}
+
+// Invoke the timers one after another, each started from the callback of
+// the one before
+static void wakeup_callback(EV_P_ ev_timer *w, int revents)
+{
+    lateness[ fired ] = EV_LT_TS( get_clock() - deadline );
+    if ( ++fired < WAKEUP_TIMERS )
+    {
+        ev_timer_set( w, delay( &wakeup_seed, 50e-6, 5e-3 ), 0 );
+        ev_timer_start( loop, w );
+        deadline = ev_at( w );
+    }
+}
+
+static int compare_lateness(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return ( x > y ) - ( x < y );
+}
+
+// Returns 0 if the kernel cannot wait this way
+static int wakeup(int mode, double *cpu_per_timer)
+{
+    struct ev_loop *loop = ev_loop_new( EVBACKEND_EPOLL );
+    ev_timer w;
+    double start;
+
+    if ( !loop || ( 0 == mode && !loop->epoll_timespec ) )
+    {
+        if ( loop )
+            ev_loop_destroy( loop );
+        return 0;
+    }
+    if ( 0 < mode && loop->epoll_timespec )
+    {
+        loop->epoll_timespec = 0;
+        epoll_timerfd_init( loop );
+    }
+    if ( 1 == mode && 0 > loop->epoll_timerfd )
+    {
+        ev_loop_destroy( loop );
+        return 0;
+    }
+    if ( 2 == mode )
+    {
+        if ( 0 <= loop->epoll_timerfd )
+            close( loop->epoll_timerfd );
+        loop->epoll_timerfd = -1;
+        loop->backend_mintime = 1e-3;
+    }
+
+    wakeup_seed = 1;
+    fired = 0;
+    ev_timer_init( &w, wakeup_callback, delay( &wakeup_seed, 50e-6, 5e-3 ), 0 );
+    ev_timer_start( loop, &w );
+    deadline = ev_at( &w );
+    start = cpu();
+    ev_run( loop, 0 );
+    *cpu_per_timer = ( cpu() - start ) / WAKEUP_TIMERS;
+
+    ev_loop_destroy( loop );
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    int opt, runs = 3, i, j, k;
+    result_t best = { 0 }, r;
+
+    while ( -1 != ( opt = getopt( argc, argv, "r:k:" ) ) )
+    {
+        switch ( opt )
+        {
+        case 'r': runs = atoi( optarg ); break;
+        case 'k': only = optarg; break;
+        default:
+            fprintf( stderr, "usage: %s [-r runs] [-k store]\n", argv[0] );
+            return 1;
+        }
+    }
+    if ( 0 >= runs )
+        runs = 1;
+
+    timers = calloc( counts[ COUNTS - 1 ], sizeof( ev_timer ) );
+    due = calloc( counts[ COUNTS - 1 ], sizeof( double ) );
+    if ( !timers || !due )
+        return 1;
+
+    for ( i = 0 ; i < COUNTS ; ++i )
+    {
+        for ( j = 0 ; j < STORES ; ++j )
+        {
+            if ( only && strcmp( only, stores[j].name ) )
+                continue;
+
+            for ( k = 0 ; k < runs ; ++k )
+            {
+                run( &stores[j], counts[i], &r );
+                if ( !k || r.start < best.start ) best.start = r.start;
+                if ( !k || r.again < best.again ) best.again = r.again;
+                if ( !k || r.stop < best.stop ) best.stop = r.stop;
+                if ( !k || r.expire < best.expire ) best.expire = r.expire;
+                if ( !k || r.late > best.late ) best.late = r.late;
+                if ( !k || r.reify < best.reify ) best.reify = r.reify;
+            }
+
+            printf( "{ \"store\": \"%s\", \"time_base\": \"%s\", \"timers\": %d, \"runs\": %d, \"start_ns\": %.1f, \"again_ns\": %.1f, \"stop_ns\": %.1f, \"expire_ns\": %.1f, \"late_ms_max\": %.3f, \"reify_ns\": %.1f }\n",
+                stores[j].name, time_base, counts[i], runs, best.start, best.again, best.stop, best.expire, best.late, best.reify );
+            fflush( stdout );
+        }
+    }
+
+    for ( j = 0 ; j < WAKEUPS ; ++j )
+    {
+        double cpu_per_timer;
+
+        if ( only && strcmp( only, wakeups[j] ) )
+            continue;
+        if ( !wakeup( j, &cpu_per_timer ) )
+        {
+            printf( "{ \"wakeup\": \"%s\", \"supported\": false }\n", wakeups[j] );
+            continue;
+        }
+
+        qsort( lateness, WAKEUP_TIMERS, sizeof( lateness[0] ), compare_lateness );
+        printf( "{ \"wakeup\": \"%s\", \"time_base\": \"%s\", \"timers\": %d, \"late_us_min\": %.1f, \"late_us_p50\": %.1f, \"late_us_p90\": %.1f, \"late_us_p99\": %.1f, \"late_us_max\": %.1f, \"cpu_us_per_timer\": %.1f }\n",
+            wakeups[j], time_base, WAKEUP_TIMERS, lateness[0] * 1e6, lateness[ WAKEUP_TIMERS / 2 ] * 1e6,
+            lateness[ WAKEUP_TIMERS * 9 / 10 ] * 1e6, lateness[ WAKEUP_TIMERS * 99 / 100 ] * 1e6,
+            lateness[ WAKEUP_TIMERS - 1 ] * 1e6, cpu_per_timer * 1e6 );
+        fflush( stdout );
+    }
+
+    return 0;
+}
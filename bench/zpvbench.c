@@ -0,0 +1,316 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// zpvbench pushes synthetic data through zpv in its different modes, and
+// through cat for a baseline, and prints one JSON line per case:
+//
+//   producer -> pipe -> zpv <args> -> pipe -> consumer
+//
+// The producer and the consumer are children of zpvbench and can be paced
+// to a given rate. Every case runs -r times and the fastest run counts. The
+// CPU time is the one of the process under test only, from wait4(2).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define CHUNK ( 64 * 1024 )
+#define MAX_ARGS 16
+
+typedef struct
+{
+    const char *name;
+    const char *args[ MAX_ARGS ]; // for zpv, NULL terminated; cat if args[0] is NULL
+    int producer_paced; // run with the producer at -p bytes per second
+    int consumer_paced; // and the consumer at -c
+} bench_case_t;
+
+// The copy loop in every mode and backend, the buffer sizes around the
+// default, and the slow producer and slow consumer cases that exercise the
+// waits rather than the copy
+static const bench_case_t cases[] =
+{
+    { "cat", { NULL } },
+    { "copy", { "zpv", NULL } },
+    { "copy-poll", { "zpv", "-b", "poll", NULL } },
+    { "copy-select", { "zpv", "-b", "select", NULL } },
+    { "copy-iouring-backend", { "zpv", "-b", "iouring", NULL } },
+    { "copy-B64k", { "zpv", "-B", "65536", "-n", "4", NULL } },
+    { "copy-B16M", { "zpv", "-B", "16777216", NULL } },
+    { "splice", { "zpv", "-s", NULL } },
+    { "iouring", { "zpv", "-u", NULL } },
+    { "threads", { "zpv", "-t", NULL } },
+    { "fanout-2", { "zpv", "-O", "3", NULL } },
+    { "copy-crc32c", { "zpv", "-H", "crc32c", NULL } },
+    { "copy-sha256", { "zpv", "-H", "sha256", NULL } },
+    { "copy-lines", { "zpv", "-l", NULL } },
+    { "cat-slow-producer", { NULL }, 1, 0 },
+    { "copy-slow-producer", { "zpv", NULL }, 1, 0 },
+    { "cat-slow-consumer", { NULL }, 0, 1 },
+    { "copy-slow-consumer", { "zpv", NULL }, 0, 1 },
+};
+#define CASES (int)( sizeof( cases ) / sizeof( cases[0] ) )
+
+long long total_bytes = 512LL * 1024 * 1024;
+long long producer_rate = 200LL * 1024 * 1024;
+long long consumer_rate = 200LL * 1024 * 1024;
+const char *zpv = "./zpv";
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Sleep until rate bytes per second would have moved done bytes since start
+static void pace(long long rate, long long done, double start)
+{
+    double ahead = (double)done / rate - ( now() - start );
+    struct timespec ts;
+    if ( 0 < ahead )
+    {
+        ts.tv_sec = ahead;
+        ts.tv_nsec = ( ahead - ts.tv_sec ) * 1e9;
+        nanosleep( &ts, NULL );
+    }
+}
+
+static void produce(long long rate)
+{
+    static char buf[ CHUNK ];
+    long long done = 0;
+    double start = now();
+    ssize_t size;
+    int i;
+
+    for ( i = 0 ; i < CHUNK ; ++i )
+        buf[i] = i * 131 + ( i >> 8 );
+
+    while ( done < total_bytes )
+    {
+        size = write( STDOUT_FILENO, buf, total_bytes - done < CHUNK ? total_bytes - done : CHUNK );
+        if ( 0 >= size )
+            exit( 1 );
+        done += size;
+        if ( rate )
+            pace( rate, done, start );
+    }
+    exit( 0 );
+}
+
+// Exits 0 only if every byte arrived
+static void consume(long long rate)
+{
+    static char buf[ CHUNK ];
+    long long done = 0;
+    double start = now();
+    ssize_t size;
+
+    while ( 0 < ( size = read( STDIN_FILENO, buf, sizeof( buf ) ) ) )
+    {
+        done += size;
+        if ( rate )
+            pace( rate, done, start );
+    }
+    exit( done == total_bytes ? 0 : 1 );
+}
+
+// Start a child on in and out, with every other pipe closed so that end of
+// file gets through. body runs a producer or consumer, otherwise args are
+// executed.
+static pid_t spawn(int in, int out, int extra, void (*body)(long long), long long rate, const char *const *args)
+{
+    pid_t pid = fork();
+    int fd;
+
+    if ( 0 != pid )
+        return pid;
+
+    if ( 0 <= in )
+        dup2( in, STDIN_FILENO );
+    if ( 0 <= out )
+        dup2( out, STDOUT_FILENO );
+    if ( 0 <= extra )
+        dup2( extra, 3 ); // the second output of fanout-2
+    for ( fd = 0 <= extra ? 4 : 3 ; fd < 1024 ; ++fd )
+        close( fd );
+    if ( body )
+        body( rate );
+
+    fd = open( "/dev/null", O_WRONLY );
+    dup2( fd, STDERR_FILENO );
+    close( fd );
+    if ( args[0] )
+        execv( zpv, (char *const *)args );
+    else
+        execlp( "cat", "cat", NULL );
+    _exit( 127 );
+}
+
+// Run one case, returning 0 on success with the wall and CPU seconds of the
+// process under test
+static int run(const bench_case_t *c, double *seconds, double *cpu)
+{
+    int to_mid[2], from_mid[2], extra[2] = { -1, -1 }, status, ok = 1;
+    pid_t producer, mid, consumer, drain = -1;
+    struct rusage usage;
+    double start;
+
+    if ( 0 != pipe( to_mid ) || 0 != pipe( from_mid ) )
+        return 1;
+    if ( c->args[0] && !strcmp( c->name, "fanout-2" ) && 0 != pipe( extra ) )
+        return 1;
+
+    start = now();
+    producer = spawn( -1, to_mid[1], -1, produce, c->producer_paced ? producer_rate : 0, NULL );
+    consumer = spawn( from_mid[0], -1, -1, consume, c->consumer_paced ? consumer_rate : 0, NULL );
+    if ( 0 <= extra[0] )
+        drain = spawn( extra[0], -1, -1, consume, 0, NULL );
+    mid = spawn( to_mid[0], from_mid[1], extra[1], NULL, 0, c->args );
+
+    close( to_mid[0] );
+    close( to_mid[1] );
+    close( from_mid[0] );
+    close( from_mid[1] );
+    if ( 0 <= extra[0] )
+    {
+        close( extra[0] );
+        close( extra[1] );
+    }
+
+    if ( mid != wait4( mid, &status, 0, &usage ) || !WIFEXITED( status ) || 0 != WEXITSTATUS( status ) )
+        ok = 0;
+    waitpid( producer, &status, 0 );
+    ok &= WIFEXITED( status ) && 0 == WEXITSTATUS( status );
+    waitpid( consumer, &status, 0 );
+    ok &= WIFEXITED( status ) && 0 == WEXITSTATUS( status );
+    if ( 0 < drain )
+    {
+        waitpid( drain, &status, 0 );
+        ok &= WIFEXITED( status ) && 0 == WEXITSTATUS( status );
+    }
+
+    *seconds = now() - start;
+    *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    return !ok;
+}
+
+static void usage(const char *name)
+{
+    fprintf( stderr, "usage: %s [-z bytes] [-r runs] [-p rate] [-c rate] [-f fraction] [-k case]... [zpv]\n"
+        "  -z  bytes to push through every case (default %lld)\n"
+        "  -r  runs per case, the fastest counts (default 3)\n"
+        "  -p  bytes per second of the slow producer (default %lld)\n"
+        "  -c  bytes per second of the slow consumer (default %lld)\n"
+        "  -f  fail if an unpaced zpv case is slower than this fraction of cat\n"
+        "  -k  run only this case, may be given several times\n"
+        "  zpv defaults to %s\n",
+        name, total_bytes, producer_rate, consumer_rate, zpv );
+}
+
+int main(int argc, char **argv)
+{
+    const char *only[ CASES ];
+    int opt, i, j, runs = 3, only_count = 0, failed = 0;
+    double fraction = 0, cat_rate = 0;
+
+    while ( -1 != ( opt = getopt( argc, argv, "z:r:p:c:f:k:" ) ) )
+    {
+        switch ( opt )
+        {
+        case 'z': total_bytes = strtoll( optarg, NULL, 0 ); break;
+        case 'r': runs = atoi( optarg ); break;
+        case 'p': producer_rate = strtoll( optarg, NULL, 0 ); break;
+        case 'c': consumer_rate = strtoll( optarg, NULL, 0 ); break;
+        case 'f': fraction = atof( optarg ); break;
+        case 'k':
+            if ( only_count < CASES )
+                only[ only_count++ ] = optarg;
+            break;
+        default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( optind < argc )
+        zpv = argv[ optind ];
+    if ( 0 >= total_bytes || 0 >= runs || 0 >= producer_rate || 0 >= consumer_rate )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    for ( i = 0 ; i < CASES ; ++i )
+    {
+        const bench_case_t *c = &cases[i];
+        double best = 0, best_cpu = 0, seconds, cpu, gb;
+        int errors = 0, k;
+
+        for ( k = 0 ; k < only_count && strcmp( only[k], c->name ) ; ++k )
+            ;
+        if ( only_count && k == only_count && strcmp( c->name, "cat" ) )
+            continue; // cat always runs, it is the baseline
+
+        for ( j = 0 ; j < runs ; ++j )
+        {
+            if ( run( c, &seconds, &cpu ) )
+                ++errors;
+            else if ( !best || seconds < best )
+            {
+                best = seconds;
+                best_cpu = cpu;
+            }
+        }
+
+        gb = total_bytes / 1e9;
+        printf( "{ \"case\": \"%s\", \"command\": \"", c->name );
+        if ( c->args[0] )
+            for ( k = 0 ; c->args[k] ; ++k )
+                printf( "%s%s", k ? " " : "", c->args[k] );
+        else
+            printf( "cat" );
+        printf( "\", \"bytes\": %lld, \"runs\": %d, \"errors\": %d", total_bytes, runs, errors );
+        if ( c->producer_paced )
+            printf( ", \"producer_rate\": %lld", producer_rate );
+        if ( c->consumer_paced )
+            printf( ", \"consumer_rate\": %lld", consumer_rate );
+        if ( best )
+        {
+            printf( ", \"seconds\": %.4f, \"gb_per_s\": %.3f, \"cpu_s_per_gb\": %.4f", best, gb / best, best_cpu / gb );
+            if ( !strcmp( c->name, "cat" ) )
+                cat_rate = gb / best;
+            else if ( cat_rate && !c->producer_paced && !c->consumer_paced )
+            {
+                printf( ", \"vs_cat\": %.3f", gb / best / cat_rate );
+                if ( fraction && gb / best < fraction * cat_rate )
+                    failed = 1;
+            }
+        }
+        printf( " }\n" );
+        fflush( stdout );
+        failed |= 0 < errors;
+    }
+
+    return failed;
+}
@@ -301,6 +301,18 @@
 # endif
 #endif
 
+#ifndef EV_USE_IOURING
+# if __linux && defined __has_include
+#  if __has_include(<linux/io_uring.h>)
+#   define EV_USE_IOURING EV_FEATURE_BACKENDS
+#  endif
+# endif
+#endif
+
+#ifndef EV_USE_IOURING
+# define EV_USE_IOURING 0
+#endif
+
 #ifndef EV_USE_KQUEUE
 # define EV_USE_KQUEUE 0
 #endif
@@ -341,6 +353,14 @@
 # endif
 #endif
 
+#ifndef EV_USE_TIMERFD
+# if __linux && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 8))
+#  define EV_USE_TIMERFD EV_FEATURE_OS
+# else
+#  define EV_USE_TIMERFD 0
+# endif
+#endif
+
 #if 0 /* debugging */
 # define EV_VERIFY 3
 # define EV_USE_4HEAP 1
@@ -359,6 +379,23 @@
 # define EV_HEAP_CACHE_AT EV_FEATURE_DATA
 #endif
 
+#ifndef EV_HEAP_SOA
+# define EV_HEAP_SOA EV_FEATURE_DATA
+#endif
+
+#if !EV_USE_4HEAP
+# undef EV_HEAP_SOA
+# define EV_HEAP_SOA 0
+#endif
+
+#ifndef EV_WHEEL_HZ
+# define EV_WHEEL_HZ 1000 /* ticks per second of the EVFLAG_TIMERWHEEL wheel */
+#endif
+
+#ifndef EV_WHEEL_MIN
+# define EV_WHEEL_MIN 0.1 /* timers shorter than this stay on the heap */
+#endif
+
 /* on linux, we can use a (slow) syscall to avoid a dependency on pthread, */
 /* which makes programs even slower. might work on other unices, too. */
 #if EV_USE_CLOCK_SYSCALL
@@ -471,6 +508,7 @@ struct signalfd_siginfo
 
 #define EV_TV_SET(tv,t) do { tv.tv_sec = (long)t; tv.tv_usec = (long)((t - tv.tv_sec) * 1e6); } while (0)
 #define EV_TS_SET(ts,t) do { ts.tv_sec = (long)t; ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9); } while (0)
+#define EV_TS_TO_MSEC(t) ((int)((t) * 1e3 + 0.9999)) /* rounded up, so timers are not woken too early */
 
 /* the following is ecb.h embedded into libev - use update_ev_c to update from an external copy */
 /* ECB.H BEGIN */
@@ -1442,6 +1480,9 @@ ev_realloc (void *ptr, long size)
 /* set in reify when reification needed */
 #define EV_ANFD_REIFY 1
 
+/* set in ANFD.emask while the epoll backend has the fd registered for good */
+#define EV_EMASK_STICKY 0x40
+
 /* file descriptor info structure */
 typedef struct
 {
@@ -1449,9 +1490,9 @@ typedef struct
   unsigned char events; /* the events watched for */
   unsigned char reify;  /* flag set when this ANFD needs reification (EV_ANFD_REIFY, EV__IOFDSET) */
   unsigned char emask;  /* the epoll backend stores the actual kernel mask in here */
-  unsigned char unused;
-#if EV_USE_EPOLL
-  unsigned int egen;    /* generation counter to counter epoll bugs */
+  unsigned char eready; /* epoll with EVFLAG_STICKY: events seen and not drained yet */
+#if EV_USE_EPOLL || EV_USE_IOURING
+  unsigned int egen;    /* generation counter to counter epoll bugs, and to match io_uring requests */
 #endif
 #if EV_SELECT_IS_WINSOCKET || EV_USE_IOCP
   SOCKET handle;
@@ -1477,10 +1518,28 @@ typedef struct
 #endif
 
 /* Heap Entry */
-#if EV_HEAP_CACHE_AT
+#if EV_HEAP_SOA
+  /* four heap elements, the at of a node's children in one 32 byte load */
+  typedef struct {
+    ev_ltime at [4];
+    WT w [4];
+  } ANHE;
+
+  #define HE_w(heap,k)          (heap) [(k) >> 2].w [(k) & 3]
+  #define HE_at(heap,k)         (heap) [(k) >> 2].at [(k) & 3]
+  #define HE_at_cache(heap,k)   HE_at (heap, k) = HE_w (heap, k)->at
+  #define HE_move(heap,to,from) HE_at (heap, to) = HE_at (heap, from), HE_w (heap, to) = HE_w (heap, from)
+  #define HE_clear(heap,k)      HE_at (heap, k) = EV_HEAP_PAD /* after the last element */
+
+  #if EV_TIME_NS
+  #define EV_HEAP_PAD INT64_MAX /* later than any timer, so never the smallest child */
+  #else
+  #define EV_HEAP_PAD 1e300
+  #endif
+#elif EV_HEAP_CACHE_AT
   /* a heap element */
   typedef struct {
-    ev_tstamp at;
+    ev_ltime at;
     WT w;
   } ANHE;
 
@@ -1496,6 +1555,60 @@ typedef struct
   #define ANHE_at_cache(he)
 #endif
 
+#if !EV_HEAP_SOA
+  /* the heap element at index k */
+  #define HE_w(heap,k)          ANHE_w ((heap) [k])
+  #define HE_at(heap,k)         ANHE_at ((heap) [k])
+  #define HE_at_cache(heap,k)   ANHE_at_cache ((heap) [k])
+  #define HE_move(heap,to,from) (heap) [to] = (heap) [from]
+  #define HE_clear(heap,k)
+#endif
+
+/* timer wheel node, see wheel_link */
+typedef struct
+{
+  WT w;     /* 0 while on the free list */
+  int next; /* in the slot, or in the free list */
+  int prev; /* 0 for the first node of a slot */
+  int slot; /* -1 while taken off the wheel to be expired or moved */
+} ANWHEEL;
+
+#define EV_WHEEL_BITS   8
+#define EV_WHEEL_SLOTS  (1 << EV_WHEEL_BITS)
+#define EV_WHEEL_LEVELS 4
+
+#if EV_TIME_NS
+# define EV_WHEEL_TICK ((ev_ltime)1000000000 / EV_WHEEL_HZ)
+#else
+# define EV_WHEEL_TICK (1. / EV_WHEEL_HZ)
+#endif
+
+/* the tick a time falls due on */
+inline_size int64_t
+wheel_tick_at (ev_ltime at)
+{
+#if EV_TIME_NS
+  return (at + EV_WHEEL_TICK - 1) / EV_WHEEL_TICK;
+#else
+  /* the conversion rounds towards zero */
+  ev_tstamp tick = at * EV_WHEEL_HZ;
+  int64_t t = (int64_t)tick;
+
+  return t + (t < tick);
+#endif
+}
+
+/* the tick a time is in */
+inline_size int64_t
+wheel_tick_floor (ev_ltime now)
+{
+#if EV_TIME_NS
+  return now / EV_WHEEL_TICK;
+#else
+  return (int64_t)ev_floor (now * EV_WHEEL_HZ);
+#endif
+}
+
 #if EV_MULTIPLICITY
 
   struct ev_loop
@@ -1555,7 +1668,7 @@ ev_time (void) EV_THROW
 }
 #endif
 
-inline_size ev_tstamp
+inline_size ev_ltime
 get_clock (void)
 {
 #if EV_USE_MONOTONIC
@@ -1563,11 +1676,15 @@ get_clock (void)
     {
       struct timespec ts;
       clock_gettime (CLOCK_MONOTONIC, &ts);
+#if EV_TIME_NS
+      return ts.tv_sec * (ev_ltime)1000000000 + ts.tv_nsec;
+#else
       return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
     }
 #endif
 
-  return ev_time ();
+  return EV_LT (ev_time ());
 }
 
 #if EV_MULTIPLICITY
@@ -1661,6 +1778,49 @@ array_realloc (int elem, void *base, int *cur, int cnt)
 #define array_free(stem, idx) \
   ev_free (stem ## s idx); stem ## cnt idx = stem ## max idx = 0; stem ## s idx = 0
 
+#if EV_HEAP_SOA
+/* heap blocks are aligned to cache lines, so the at of four children never */
+/* span two. the byte before the heap gives its offset into the allocation */
+#define HEAP_ALIGN 64
+
+static void * noinline ecb_cold
+heap_realloc (void *heap, int *cur, int cnt)
+{
+  int ocur = *cur / 4, off = heap ? ((unsigned char *)heap) [-1] : 0;
+  unsigned char *base = heap ? (unsigned char *)heap - off : 0;
+  ANHE *blocks;
+  int i;
+
+  *cur = array_nextsize (sizeof (ANHE), ocur, (cnt + 3) / 4);
+  base = (unsigned char *)ev_realloc (base, *cur * sizeof (ANHE) + HEAP_ALIGN);
+  blocks = (ANHE *)(((uintptr_t)base + HEAP_ALIGN) & ~(uintptr_t)(HEAP_ALIGN - 1));
+
+  if (ocur && (unsigned char *)blocks != base + off)
+    memmove (blocks, base + off, ocur * sizeof (ANHE));
+  ((unsigned char *)blocks) [-1] = (unsigned char *)blocks - base;
+
+  for (i = ocur * 4; i < *cur * 4; ++i)
+    {
+      HE_clear (blocks, i);
+      HE_w (blocks, i) = 0;
+    }
+
+  *cur *= 4;
+  return blocks;
+}
+
+#define heap_needsize(heap,cur,cnt)			\
+  if (expect_false ((cnt) > (cur)))			\
+    (heap) = (ANHE *)heap_realloc ((heap), &(cur), (cnt))
+
+#define heap_free(stem) \
+  if (stem ## s) ev_free ((unsigned char *)stem ## s - ((unsigned char *)stem ## s) [-1]); \
+  stem ## cnt = stem ## max = 0; stem ## s = 0
+#else
+#define heap_needsize(heap,cur,cnt) array_needsize (ANHE, heap, cur, cnt, EMPTY2)
+#define heap_free(stem) array_free (stem, EMPTY)
+#endif
+
 /*****************************************************************************/
 
 /* dummy callback for pending events */
@@ -1747,6 +1907,13 @@ ev_feed_fd_event (EV_P_ int fd, int revents) EV_THROW
     fd_event_nocheck (EV_A_ fd, revents);
 }
 
+void
+ev_io_drained (EV_P_ ev_io *w, int revents) EV_THROW
+{
+  if (w->fd >= 0 && w->fd < anfdmax)
+    anfds [w->fd].eready &= ~revents;
+}
+
 /* make sure the external fd watch events are in-sync */
 /* with the kernel/libev internal state */
 inline_size void
@@ -1790,6 +1957,12 @@ fd_reify (EV_P)
 
       anfd->reify  = 0;
 
+#if EV_USE_EPOLL
+      /* the fd may refer to another file now, register it again */
+      if (o_reify & EV__IOFDSET)
+        anfd->emask &= ~EV_EMASK_STICKY;
+#endif
+
       /*if (expect_true (o_reify & EV_ANFD_REIFY)) probably a deoptimisation */
         {
           anfd->events = 0;
@@ -1923,6 +2096,71 @@ fd_intern (int fd)
 #define HPARENT(k) ((((k) - HEAP0 - 1) / DHEAP) + HEAP0)
 #define UPHEAP_DONE(p,k) ((p) == (k))
 
+#if EV_HEAP_SOA
+
+#if __SSE2__ && !EV_TIME_NS
+# include <emmintrin.h>
+#endif
+
+/* the index of the earliest of four at, the first of equal ones */
+inline_speed int
+heap_minchild (const ev_ltime *at)
+{
+#if __SSE2__ && !EV_TIME_NS
+  __m128d lo = _mm_load_pd (at);
+  __m128d hi = _mm_load_pd (at + 2);
+  __m128d min = _mm_min_pd (lo, hi);
+
+  min = _mm_min_pd (min, _mm_shuffle_pd (min, min, 1));
+  return ecb_ctz32 (_mm_movemask_pd (_mm_cmpeq_pd (lo, min)) | _mm_movemask_pd (_mm_cmpeq_pd (hi, min)) << 2);
+#else
+  /* keep the smaller values rather than load them again by index */
+  int i = at [1] < at [0];
+  int j = at [3] < at [2];
+  ev_ltime a = i ? at [1] : at [0];
+  ev_ltime b = j ? at [3] : at [2];
+
+  return b < a ? j + 2 : i;
+#endif
+}
+
+/* away from the root. the children of k are the block at k - HEAP0 + 1, */
+/* elements past the end are EV_HEAP_PAD, so no bounds checks are needed */
+inline_speed void
+downheap (ANHE *heap, int N, int k)
+{
+  ev_ltime at = HE_at (heap, k);
+  WT w = HE_w (heap, k);
+
+  for (;;)
+    {
+      int c = DHEAP * (k - HEAP0) + HEAP0 + 1;
+      ANHE *children;
+      int i;
+
+      if (c >= N + HEAP0)
+        break;
+
+      children = heap + k - HEAP0 + 1;
+      i = heap_minchild (children->at);
+
+      if (at <= children->at [i])
+        break;
+
+      HE_at (heap, k) = children->at [i];
+      HE_w (heap, k) = children->w [i];
+      ev_active (children->w [i]) = k;
+
+      k = c + i;
+    }
+
+  HE_at (heap, k) = at;
+  HE_w (heap, k) = w;
+  ev_active (w) = k;
+}
+
+#else
+
 /* away from the root */
 inline_speed void
 downheap (ANHE *heap, int N, int k)
@@ -1932,7 +2170,7 @@ downheap (ANHE *heap, int N, int k)
 
   for (;;)
     {
-      ev_tstamp minat;
+      ev_ltime minat;
       ANHE *minpos;
       ANHE *pos = heap + DHEAP * (k - HEAP0) + HEAP0 + 1;
 
@@ -1967,6 +2205,8 @@ downheap (ANHE *heap, int N, int k)
   ev_active (ANHE_w (he)) = k;
 }
 
+#endif
+
 #else /* 4HEAP */
 
 #define HEAP0 1
@@ -2004,6 +2244,30 @@ downheap (ANHE *heap, int N, int k)
 #endif
 
 /* towards the root */
+#if EV_HEAP_SOA
+inline_speed void
+upheap (ANHE *heap, int k)
+{
+  ev_ltime at = HE_at (heap, k);
+  WT w = HE_w (heap, k);
+
+  for (;;)
+    {
+      int p = HPARENT (k);
+
+      if (UPHEAP_DONE (p, k) || HE_at (heap, p) <= at)
+        break;
+
+      HE_move (heap, k, p);
+      ev_active (HE_w (heap, k)) = k;
+      k = p;
+    }
+
+  HE_at (heap, k) = at;
+  HE_w (heap, k) = w;
+  ev_active (w) = k;
+}
+#else
 inline_speed void
 upheap (ANHE *heap, int k)
 {
@@ -2024,12 +2288,13 @@ upheap (ANHE *heap, int k)
   heap [k] = he;
   ev_active (ANHE_w (he)) = k;
 }
+#endif
 
 /* move an element suitably so it is in a correct place */
 inline_size void
 adjustheap (ANHE *heap, int N, int k)
 {
-  if (k > HEAP0 && ANHE_at (heap [k]) <= ANHE_at (heap [HPARENT (k)]))
+  if (k > HEAP0 && HE_at (heap, k) <= HE_at (heap, HPARENT (k)))
     upheap (heap, k);
   else
     downheap (heap, N, k);
@@ -2172,6 +2437,7 @@ pipecb (EV_P_ ev_io *iow, int revents)
         {
           uint64_t counter;
           read (evpipe [1], &counter, sizeof (uint64_t));
+          ev_io_drained (EV_A_ iow, EV_READ);
         }
       else
 #endif
@@ -2187,6 +2453,8 @@ pipecb (EV_P_ ev_io *iow, int revents)
 #else
           read (evpipe [0], &dummy, sizeof (dummy));
 #endif
+          /* every flag is looked at below, whatever is left in the pipe */
+          ev_io_drained (EV_A_ iow, EV_READ);
         }
     }
 
@@ -2292,7 +2560,10 @@ sigfdcb (EV_P_ ev_io *iow, int revents)
         ev_feed_signal_event (EV_A_ sip->ssi_signo);
 
       if (res < (ssize_t)sizeof (si))
-        break;
+        {
+          ev_io_drained (EV_A_ iow, EV_READ);
+          break;
+        }
     }
 }
 #endif
@@ -2369,6 +2640,9 @@ childcb (EV_P_ ev_signal *sw, int revents)
 #if EV_USE_KQUEUE
 # include "ev_kqueue.c"
 #endif
+#if EV_USE_IOURING
+# include "ev_iouring.c"
+#endif
 #if EV_USE_EPOLL
 # include "ev_epoll.c"
 #endif
@@ -2410,6 +2684,7 @@ ev_supported_backends (void) EV_THROW
 
   if (EV_USE_PORT  ) flags |= EVBACKEND_PORT;
   if (EV_USE_KQUEUE) flags |= EVBACKEND_KQUEUE;
+  if (EV_USE_IOURING) flags |= EVBACKEND_IOURING;
   if (EV_USE_EPOLL ) flags |= EVBACKEND_EPOLL;
   if (EV_USE_POLL  ) flags |= EVBACKEND_POLL;
   if (EV_USE_SELECT) flags |= EVBACKEND_SELECT;
@@ -2436,6 +2711,9 @@ ev_recommended_backends (void) EV_THROW
   flags &= ~EVBACKEND_POLL;   /* poll return value is unusable (http://forums.freebsd.org/archive/index.php/t-10270.html) */
 #endif
 
+  /* io_uring is often disabled or filtered (seccomp, kernel.io_uring_disabled), so it must be asked for */
+  flags &= ~EVBACKEND_IOURING;
+
   return flags;
 }
 
@@ -2550,7 +2828,9 @@ loop_init (EV_P_ unsigned int flags) EV_THROW
       ev_rt_now          = ev_time ();
       mn_now             = get_clock ();
       now_floor          = mn_now;
-      rtmn_diff          = ev_rt_now - mn_now;
+      rtmn_diff          = ev_rt_now - EV_LT_TS (mn_now);
+      wheel_enabled      = !!(flags & EVFLAG_TIMERWHEEL);
+      wheel_tick         = wheel_tick_floor (mn_now);
 #if EV_FEATURE_API
       invoke_cb          = ev_invoke_pending;
 #endif
@@ -2586,6 +2866,9 @@ loop_init (EV_P_ unsigned int flags) EV_THROW
 #if EV_USE_KQUEUE
       if (!backend && (flags & EVBACKEND_KQUEUE)) backend = kqueue_init (EV_A_ flags);
 #endif
+#if EV_USE_IOURING
+      if (!backend && (flags & EVBACKEND_IOURING)) backend = iouring_init (EV_A_ flags);
+#endif
 #if EV_USE_EPOLL
       if (!backend && (flags & EVBACKEND_EPOLL )) backend = epoll_init  (EV_A_ flags);
 #endif
@@ -2665,6 +2948,9 @@ ev_loop_destroy (EV_P)
 #if EV_USE_KQUEUE
   if (backend == EVBACKEND_KQUEUE) kqueue_destroy (EV_A);
 #endif
+#if EV_USE_IOURING
+  if (backend == EVBACKEND_IOURING) iouring_destroy (EV_A);
+#endif
 #if EV_USE_EPOLL
   if (backend == EVBACKEND_EPOLL ) epoll_destroy  (EV_A);
 #endif
@@ -2688,9 +2974,13 @@ ev_loop_destroy (EV_P)
   /* have to use the microsoft-never-gets-it-right macro */
   array_free (rfeed, EMPTY);
   array_free (fdchange, EMPTY);
-  array_free (timer, EMPTY);
+  heap_free (timer);
+  array_free (wheel_node, EMPTY);
+  wheel_free = wheel_count = 0;
+  memset (wheel_slots, 0, sizeof (wheel_slots));
+  memset (wheel_bits, 0, sizeof (wheel_bits));
 #if EV_PERIODIC_ENABLE
-  array_free (periodic, EMPTY);
+  heap_free (periodic);
 #endif
 #if EV_FORK_ENABLE
   array_free (fork, EMPTY);
@@ -2729,6 +3019,9 @@ loop_fork (EV_P)
 #if EV_USE_KQUEUE
   if (backend == EVBACKEND_KQUEUE) kqueue_fork (EV_A);
 #endif
+#if EV_USE_IOURING
+  if (backend == EVBACKEND_IOURING) iouring_fork (EV_A);
+#endif
 #if EV_USE_EPOLL
   if (backend == EVBACKEND_EPOLL ) epoll_fork  (EV_A);
 #endif
@@ -2792,11 +3085,11 @@ verify_heap (EV_P_ ANHE *heap, int N)
 
   for (i = HEAP0; i < N + HEAP0; ++i)
     {
-      assert (("libev: active index mismatch in heap", ev_active (ANHE_w (heap [i])) == i));
-      assert (("libev: heap condition violated", i == HEAP0 || ANHE_at (heap [HPARENT (i)]) <= ANHE_at (heap [i])));
-      assert (("libev: heap at cache mismatch", ANHE_at (heap [i]) == ev_at (ANHE_w (heap [i]))));
+      assert (("libev: active index mismatch in heap", ev_active (HE_w (heap, i)) == i));
+      assert (("libev: heap condition violated", i == HEAP0 || HE_at (heap, HPARENT (i)) <= HE_at (heap, i)));
+      assert (("libev: heap at cache mismatch", HE_at (heap, i) == ev_at (HE_w (heap, i))));
 
-      verify_watcher (EV_A_ (W)ANHE_w (heap [i]));
+      verify_watcher (EV_A_ (W)HE_w (heap, i));
     }
 }
 
@@ -2848,6 +3141,14 @@ ev_verify (EV_P) EV_THROW
   assert (timermax >= timercnt);
   verify_heap (EV_A_ timers, timercnt);
 
+  assert (wheel_nodemax >= wheel_nodecnt);
+  for (i = 1; i < wheel_nodecnt; ++i)
+    if (wheel_nodes [i].w)
+      {
+        assert (("libev: active index mismatch on timer wheel", ev_active (wheel_nodes [i].w) == -i));
+        verify_watcher (EV_A_ (W)wheel_nodes [i].w);
+      }
+
 #if EV_PERIODIC_ENABLE
   assert (periodicmax >= periodiccnt);
   verify_heap (EV_A_ periodics, periodiccnt);
@@ -3008,24 +3309,24 @@ timers_reify (EV_P)
 {
   EV_FREQUENT_CHECK;
 
-  if (timercnt && ANHE_at (timers [HEAP0]) < mn_now)
+  if (timercnt && HE_at (timers, HEAP0) < mn_now)
     {
       do
         {
-          ev_timer *w = (ev_timer *)ANHE_w (timers [HEAP0]);
+          ev_timer *w = (ev_timer *)HE_w (timers, HEAP0);
 
           /*assert (("libev: inactive timer on timer heap detected", ev_is_active (w)));*/
 
           /* first reschedule or stop timer */
           if (w->repeat)
             {
-              ev_at (w) += w->repeat;
+              ev_at (w) += EV_LT (w->repeat);
               if (ev_at (w) < mn_now)
                 ev_at (w) = mn_now;
 
               assert (("libev: negative ev_timer repeat value found while processing timers", w->repeat > 0.));
 
-              ANHE_at_cache (timers [HEAP0]);
+              HE_at_cache (timers, HEAP0);
               downheap (timers, timercnt, HEAP0);
             }
           else
@@ -3034,12 +3335,208 @@ timers_reify (EV_P)
           EV_FREQUENT_CHECK;
           feed_reverse (EV_A_ (W)w);
         }
-      while (timercnt && ANHE_at (timers [HEAP0]) < mn_now);
+      while (timercnt && HE_at (timers, HEAP0) < mn_now);
 
       feed_reverse_done (EV_A_ EV_TIMER);
     }
 }
 
+/*
+ * with EVFLAG_TIMERWHEEL, timers of EV_WHEEL_MIN seconds or more go on a
+ * hierarchical timing wheel instead of the heap. it has EV_WHEEL_LEVELS
+ * levels of EV_WHEEL_SLOTS slots, a slot of the first level being one tick
+ * of 1/EV_WHEEL_HZ seconds and every further level EV_WHEEL_SLOTS times
+ * coarser. a timer is filed under the tick it falls due on, in the finest
+ * level that reaches that far, and moves down when the wheel turns to its
+ * slot. this makes start, stop and again O(1), and a slot expires at once.
+ *
+ * the timer keeps its exact ev_at, so ev_timer_remaining is exact, but it
+ * is invoked on the first tick at or after it, up to a tick late, and in no
+ * particular order within a tick. timers that need better stay on the heap.
+ *
+ * a wheel timer's ev_active is minus the index of its node in wheel_nodes.
+ */
+
+inline_size void
+wheel_link (EV_P_ int n)
+{
+  ANWHEEL *node = wheel_nodes + n;
+  int64_t t = wheel_tick_at (node->w->at);
+  int level;
+
+  if (t < wheel_tick)
+    t = wheel_tick;
+
+  /* beyond the coarsest level, park the timer as far as it goes, it gets */
+  /* filed again when the wheel turns to it */
+  if (t - wheel_tick >= (int64_t)1 << (EV_WHEEL_BITS * EV_WHEEL_LEVELS))
+    t = wheel_tick + ((int64_t)1 << (EV_WHEEL_BITS * EV_WHEEL_LEVELS)) - 1;
+
+  level = t > wheel_tick ? ecb_ld64 (t - wheel_tick) / EV_WHEEL_BITS : 0;
+
+  node->slot = level * EV_WHEEL_SLOTS + (int)((t >> (EV_WHEEL_BITS * level)) & (EV_WHEEL_SLOTS - 1));
+  node->prev = 0;
+  node->next = wheel_slots [node->slot];
+  if (node->next)
+    wheel_nodes [node->next].prev = n;
+  wheel_slots [node->slot] = n;
+  wheel_bits [node->slot >> 5] |= 1U << (node->slot & 31);
+}
+
+inline_size void
+wheel_unlink (EV_P_ int n)
+{
+  ANWHEEL *node = wheel_nodes + n;
+
+  if (node->slot < 0)
+    return;
+
+  if (node->prev)
+    wheel_nodes [node->prev].next = node->next;
+  else if (!(wheel_slots [node->slot] = node->next))
+    wheel_bits [node->slot >> 5] &= ~(1U << (node->slot & 31));
+
+  if (node->next)
+    wheel_nodes [node->next].prev = node->prev;
+}
+
+/* take all timers off a slot, returning the first, linked through next */
+inline_size int
+wheel_take (EV_P_ int slot)
+{
+  int first = wheel_slots [slot], n;
+
+  wheel_slots [slot] = 0;
+  wheel_bits [slot >> 5] &= ~(1U << (slot & 31));
+
+  for (n = first; n; n = wheel_nodes [n].next)
+    wheel_nodes [n].slot = -1;
+
+  return first;
+}
+
+/* the first slot in use of a level, from slot i on, or EV_WHEEL_SLOTS */
+inline_size int
+wheel_scan (EV_P_ int level, int i)
+{
+  uint32_t *bits = wheel_bits + level * (EV_WHEEL_SLOTS / 32);
+
+  for (; i < EV_WHEEL_SLOTS; i = (i | 31) + 1)
+    if (bits [i >> 5] >> (i & 31))
+      return i + ecb_ctz32 (bits [i >> 5] >> (i & 31));
+
+  return EV_WHEEL_SLOTS;
+}
+
+/* the next tick that expires or moves timers, wheel_count must be nonzero */
+static int64_t noinline
+wheel_next (EV_P)
+{
+  int level, shift, i;
+
+  for (level = 0; level < EV_WHEEL_LEVELS; ++level)
+    {
+      int64_t span = (int64_t)1 << (shift = EV_WHEEL_BITS * level);
+      int64_t round = span << EV_WHEEL_BITS;
+
+      /* a coarser slot is emptied when the wheel turns to its first tick, */
+      /* after that the current one is a whole round away */
+      i = (wheel_tick >> shift) & (EV_WHEEL_SLOTS - 1);
+      i = wheel_scan (EV_A_ level, i + (level && wheel_tick & (span - 1)));
+
+      if (i < EV_WHEEL_SLOTS)
+        return wheel_tick / round * round + i * span;
+
+      /* slots before the current one come round in the next round */
+      if (wheel_scan (EV_A_ level, 0) < EV_WHEEL_SLOTS)
+        return (wheel_tick / round + 1) * round;
+    }
+
+  assert (("libev: timer wheel count mismatch", 0));
+  return wheel_tick;
+}
+
+/* turn the wheel to tick t, moving down the timers of the coarser slots */
+/* starting there and expiring the ones of the tick */
+inline_size void
+wheel_turn (EV_P_ int64_t t)
+{
+  int level, n, next;
+
+  wheel_tick = t;
+
+  for (level = EV_WHEEL_LEVELS; --level; )
+    if (!(t & (((int64_t)1 << (EV_WHEEL_BITS * level)) - 1)))
+      for (n = wheel_take (EV_A_ level * EV_WHEEL_SLOTS + (int)((t >> (EV_WHEEL_BITS * level)) & (EV_WHEEL_SLOTS - 1))); n; n = next)
+        {
+          next = wheel_nodes [n].next;
+          wheel_link (EV_A_ n);
+        }
+
+  /* whatever gets filed from here on is due on a later tick */
+  wheel_tick = t + 1;
+
+  for (n = wheel_take (EV_A_ (int)(t & (EV_WHEEL_SLOTS - 1))); n; n = next)
+    {
+      ev_timer *w = (ev_timer *)wheel_nodes [n].w;
+      next = wheel_nodes [n].next;
+
+      if (wheel_tick_at (ev_at (w)) > t)
+        wheel_link (EV_A_ n); /* parked, see wheel_link */
+      else
+        {
+          if (w->repeat)
+            {
+              ev_at (w) += EV_LT (w->repeat);
+              if (ev_at (w) < mn_now)
+                ev_at (w) = mn_now;
+
+              wheel_link (EV_A_ n);
+            }
+          else
+            ev_timer_stop (EV_A_ w);
+
+          feed_reverse (EV_A_ (W)w);
+        }
+    }
+}
+
+/* make wheel timers pending */
+inline_size void
+wheel_reify (EV_P)
+{
+  int64_t now = wheel_tick_floor (mn_now), t;
+
+  EV_FREQUENT_CHECK;
+
+  while (wheel_count && (t = wheel_next (EV_A)) <= now)
+    wheel_turn (EV_A_ t);
+
+  if (wheel_tick <= now)
+    wheel_tick = now + 1;
+
+  if (rfeedcnt)
+    feed_reverse_done (EV_A_ EV_TIMER);
+}
+
+/* file all wheel timers again, after a change of their times */
+static void noinline ecb_cold
+wheel_reschedule (EV_P_ ev_ltime adjust)
+{
+  int n;
+
+  memset (wheel_slots, 0, sizeof (wheel_slots));
+  memset (wheel_bits, 0, sizeof (wheel_bits));
+  wheel_tick = wheel_tick_floor (mn_now);
+
+  for (n = 1; n < wheel_nodecnt; ++n)
+    if (wheel_nodes [n].w)
+      {
+        wheel_nodes [n].w->at += adjust;
+        wheel_link (EV_A_ n);
+      }
+}
+
 #if EV_PERIODIC_ENABLE
 
 static void noinline
@@ -3063,7 +3560,7 @@ periodic_recalc (EV_P_ ev_periodic *w)
       at = nat;
     }
 
-  ev_at (w) = at;
+  ev_at (w) = EV_LT (at);
 }
 
 /* make periodics pending */
@@ -3072,28 +3569,28 @@ periodics_reify (EV_P)
 {
   EV_FREQUENT_CHECK;
 
-  while (periodiccnt && ANHE_at (periodics [HEAP0]) < ev_rt_now)
+  while (periodiccnt && HE_at (periodics, HEAP0) < EV_LT (ev_rt_now))
     {
       do
         {
-          ev_periodic *w = (ev_periodic *)ANHE_w (periodics [HEAP0]);
+          ev_periodic *w = (ev_periodic *)HE_w (periodics, HEAP0);
 
           /*assert (("libev: inactive timer on periodic heap detected", ev_is_active (w)));*/
 
           /* first reschedule or stop timer */
           if (w->reschedule_cb)
             {
-              ev_at (w) = w->reschedule_cb (w, ev_rt_now);
+              ev_at (w) = EV_LT (w->reschedule_cb (w, ev_rt_now));
 
-              assert (("libev: ev_periodic reschedule callback returned time in the past", ev_at (w) >= ev_rt_now));
+              assert (("libev: ev_periodic reschedule callback returned time in the past", ev_at (w) >= EV_LT (ev_rt_now)));
 
-              ANHE_at_cache (periodics [HEAP0]);
+              HE_at_cache (periodics, HEAP0);
               downheap (periodics, periodiccnt, HEAP0);
             }
           else if (w->interval)
             {
               periodic_recalc (EV_A_ w);
-              ANHE_at_cache (periodics [HEAP0]);
+              HE_at_cache (periodics, HEAP0);
               downheap (periodics, periodiccnt, HEAP0);
             }
           else
@@ -3102,7 +3599,7 @@ periodics_reify (EV_P)
           EV_FREQUENT_CHECK;
           feed_reverse (EV_A_ (W)w);
         }
-      while (periodiccnt && ANHE_at (periodics [HEAP0]) < ev_rt_now);
+      while (periodiccnt && HE_at (periodics, HEAP0) < EV_LT (ev_rt_now));
 
       feed_reverse_done (EV_A_ EV_PERIODIC);
     }
@@ -3118,14 +3615,14 @@ periodics_reschedule (EV_P)
   /* adjust periodics after time jump */
   for (i = HEAP0; i < periodiccnt + HEAP0; ++i)
     {
-      ev_periodic *w = (ev_periodic *)ANHE_w (periodics [i]);
+      ev_periodic *w = (ev_periodic *)HE_w (periodics, i);
 
       if (w->reschedule_cb)
-        ev_at (w) = w->reschedule_cb (w, ev_rt_now);
+        ev_at (w) = EV_LT (w->reschedule_cb (w, ev_rt_now));
       else if (w->interval)
         periodic_recalc (EV_A_ w);
 
-      ANHE_at_cache (periodics [i]);
+      HE_at_cache (periodics, i);
     }
 
   reheap (periodics, periodiccnt);
@@ -3134,16 +3631,18 @@ periodics_reschedule (EV_P)
 
 /* adjust all timers by a given offset */
 static void noinline ecb_cold
-timers_reschedule (EV_P_ ev_tstamp adjust)
+timers_reschedule (EV_P_ ev_ltime adjust)
 {
   int i;
 
   for (i = 0; i < timercnt; ++i)
     {
-      ANHE *he = timers + i + HEAP0;
-      ANHE_w (*he)->at += adjust;
-      ANHE_at_cache (*he);
+      HE_w (timers, i + HEAP0)->at += adjust;
+      HE_at_cache (timers, i + HEAP0);
     }
+
+  if (wheel_count)
+    wheel_reschedule (EV_A_ adjust);
 }
 
 /* fetch new monotonic and realtime times from the kernel */
@@ -3161,9 +3660,9 @@ time_update (EV_P_ ev_tstamp max_block)
 
       /* only fetch the realtime clock every 0.5*MIN_TIMEJUMP seconds */
       /* interpolate in the meantime */
-      if (expect_true (mn_now - now_floor < MIN_TIMEJUMP * .5))
+      if (expect_true (mn_now - now_floor < EV_LT (MIN_TIMEJUMP * .5)))
         {
-          ev_rt_now = rtmn_diff + mn_now;
+          ev_rt_now = rtmn_diff + EV_LT_TS (mn_now);
           return;
         }
 
@@ -3181,7 +3680,7 @@ time_update (EV_P_ ev_tstamp max_block)
       for (i = 4; --i; )
         {
           ev_tstamp diff;
-          rtmn_diff = ev_rt_now - mn_now;
+          rtmn_diff = ev_rt_now - EV_LT_TS (mn_now);
 
           diff = odiff - rtmn_diff;
 
@@ -3204,16 +3703,16 @@ time_update (EV_P_ ev_tstamp max_block)
     {
       ev_rt_now = ev_time ();
 
-      if (expect_false (mn_now > ev_rt_now || ev_rt_now > mn_now + max_block + MIN_TIMEJUMP))
+      if (expect_false (EV_LT_TS (mn_now) > ev_rt_now || ev_rt_now > EV_LT_TS (mn_now) + max_block + MIN_TIMEJUMP))
         {
           /* adjust timers. this is easy, as the offset is the same for all of them */
-          timers_reschedule (EV_A_ ev_rt_now - mn_now);
+          timers_reschedule (EV_A_ EV_LT (ev_rt_now) - mn_now);
 #if EV_PERIODIC_ENABLE
           periodics_reschedule (EV_A);
 #endif
         }
 
-      mn_now = ev_rt_now;
+      mn_now = EV_LT (ev_rt_now);
     }
 }
 
@@ -3280,7 +3779,7 @@ ev_run (EV_P_ int flags)
         ev_tstamp sleeptime = 0.;
 
         /* remember old timestamp for io_blocktime calculation */
-        ev_tstamp prev_mn_now = mn_now;
+        ev_ltime prev_mn_now = mn_now;
 
         /* update time to cancel out callback processing overhead */
         time_update (EV_A_ 1e100);
@@ -3296,14 +3795,20 @@ ev_run (EV_P_ int flags)
 
             if (timercnt)
               {
-                ev_tstamp to = ANHE_at (timers [HEAP0]) - mn_now;
+                ev_tstamp to = EV_LT_TS (HE_at (timers, HEAP0) - mn_now);
+                if (waittime > to) waittime = to;
+              }
+
+            if (wheel_count)
+              {
+                ev_tstamp to = EV_LT_TS (wheel_next (EV_A) * EV_WHEEL_TICK - mn_now);
                 if (waittime > to) waittime = to;
               }
 
 #if EV_PERIODIC_ENABLE
             if (periodiccnt)
               {
-                ev_tstamp to = ANHE_at (periodics [HEAP0]) - ev_rt_now;
+                ev_tstamp to = EV_LT_TS (HE_at (periodics, HEAP0)) - ev_rt_now;
                 if (waittime > to) waittime = to;
               }
 #endif
@@ -3320,7 +3825,7 @@ ev_run (EV_P_ int flags)
             /* extra check because io_blocktime is commonly 0 */
             if (expect_false (io_blocktime))
               {
-                sleeptime = io_blocktime - (mn_now - prev_mn_now);
+                sleeptime = io_blocktime - EV_LT_TS (mn_now - prev_mn_now);
 
                 if (sleeptime > waittime - backend_mintime)
                   sleeptime = waittime - backend_mintime;
@@ -3356,6 +3861,7 @@ ev_run (EV_P_ int flags)
 
       /* queue pending timers and reschedule them */
       timers_reify (EV_A); /* relative timers called last */
+      wheel_reify (EV_A);
 #if EV_PERIODIC_ENABLE
       periodics_reify (EV_A); /* absolute timers called first */
 #endif
@@ -3422,7 +3928,7 @@ ev_suspend (EV_P) EV_THROW
 void
 ev_resume (EV_P) EV_THROW
 {
-  ev_tstamp mn_prev = mn_now;
+  ev_ltime mn_prev = mn_now;
 
   ev_now_update (EV_A);
   timers_reschedule (EV_A_ mn_now - mn_prev);
@@ -3556,23 +4062,71 @@ ev_io_stop (EV_P_ ev_io *w) EV_THROW
   EV_FREQUENT_CHECK;
 }
 
+static void noinline
+wheel_start (EV_P_ ev_timer *w)
+{
+  int n;
+
+  if (wheel_free)
+    {
+      n = wheel_free;
+      wheel_free = wheel_nodes [n].next;
+    }
+  else
+    {
+      n = wheel_nodecnt + !wheel_nodecnt;
+      wheel_nodecnt = n + 1;
+      array_needsize (ANWHEEL, wheel_nodes, wheel_nodemax, wheel_nodecnt, EMPTY2);
+    }
+
+  ++wheel_count;
+  ev_start (EV_A_ (W)w, -n);
+  wheel_nodes [n].w = (WT)w;
+  wheel_link (EV_A_ n);
+}
+
+static void noinline
+wheel_stop (EV_P_ ev_timer *w)
+{
+  int n = -ev_active (w);
+
+  assert (("libev: internal timer wheel corruption", wheel_nodes [n].w == (WT)w));
+
+  wheel_unlink (EV_A_ n);
+  wheel_nodes [n].w = 0;
+  wheel_nodes [n].next = wheel_free;
+  wheel_free = n;
+  --wheel_count;
+}
+
 void noinline
 ev_timer_start (EV_P_ ev_timer *w) EV_THROW
 {
   if (expect_false (ev_is_active (w)))
     return;
 
-  ev_at (w) += mn_now;
-
   assert (("libev: ev_timer_start called with negative timer repeat value", w->repeat >= 0.));
 
+  if (expect_false (wheel_enabled) && ev_at (w) >= EV_LT (EV_WHEEL_MIN))
+    {
+      EV_FREQUENT_CHECK;
+
+      ev_at (w) += mn_now;
+      wheel_start (EV_A_ w);
+
+      EV_FREQUENT_CHECK;
+      return;
+    }
+
+  ev_at (w) += mn_now;
+
   EV_FREQUENT_CHECK;
 
   ++timercnt;
   ev_start (EV_A_ (W)w, timercnt + HEAP0 - 1);
-  array_needsize (ANHE, timers, timermax, ev_active (w) + 1, EMPTY2);
-  ANHE_w (timers [ev_active (w)]) = (WT)w;
-  ANHE_at_cache (timers [ev_active (w)]);
+  heap_needsize (timers, timermax, ev_active (w) + 1);
+  HE_w (timers, ev_active (w)) = (WT)w;
+  HE_at_cache (timers, ev_active (w));
   upheap (timers, ev_active (w));
 
   EV_FREQUENT_CHECK;
@@ -3589,18 +4143,24 @@ ev_timer_stop (EV_P_ ev_timer *w) EV_THROW
 
   EV_FREQUENT_CHECK;
 
+  if (ev_active (w) < 0)
+    wheel_stop (EV_A_ w);
+  else
   {
     int active = ev_active (w);
 
-    assert (("libev: internal timer heap corruption", ANHE_w (timers [active]) == (WT)w));
+    assert (("libev: internal timer heap corruption", HE_w (timers, active) == (WT)w));
 
     --timercnt;
 
     if (expect_true (active < timercnt + HEAP0))
       {
-        timers [active] = timers [timercnt + HEAP0];
+        HE_move (timers, active, timercnt + HEAP0);
+        HE_clear (timers, timercnt + HEAP0);
         adjustheap (timers, timercnt, active);
       }
+    else
+      HE_clear (timers, active);
   }
 
   ev_at (w) -= mn_now;
@@ -3621,16 +4181,25 @@ ev_timer_again (EV_P_ ev_timer *w) EV_THROW
     {
       if (w->repeat)
         {
-          ev_at (w) = mn_now + w->repeat;
-          ANHE_at_cache (timers [ev_active (w)]);
-          adjustheap (timers, timercnt, ev_active (w));
+          ev_at (w) = mn_now + EV_LT (w->repeat);
+
+          if (ev_active (w) < 0)
+            {
+              wheel_unlink (EV_A_ -ev_active (w));
+              wheel_link (EV_A_ -ev_active (w));
+            }
+          else
+            {
+              HE_at_cache (timers, ev_active (w));
+              adjustheap (timers, timercnt, ev_active (w));
+            }
         }
       else
         ev_timer_stop (EV_A_ w);
     }
   else if (w->repeat)
     {
-      ev_at (w) = w->repeat;
+      ev_at (w) = EV_LT (w->repeat);
       ev_timer_start (EV_A_ w);
     }
 
@@ -3640,7 +4209,7 @@ ev_timer_again (EV_P_ ev_timer *w) EV_THROW
 ev_tstamp
 ev_timer_remaining (EV_P_ ev_timer *w) EV_THROW
 {
-  return ev_at (w) - (ev_is_active (w) ? mn_now : 0.);
+  return EV_LT_TS (ev_at (w) - (ev_is_active (w) ? mn_now : 0));
 }
 
 #if EV_PERIODIC_ENABLE
@@ -3651,27 +4220,27 @@ ev_periodic_start (EV_P_ ev_periodic *w) EV_THROW
     return;
 
   if (w->reschedule_cb)
-    ev_at (w) = w->reschedule_cb (w, ev_rt_now);
+    ev_at (w) = EV_LT (w->reschedule_cb (w, ev_rt_now));
   else if (w->interval)
     {
       assert (("libev: ev_periodic_start called with negative interval value", w->interval >= 0.));
       periodic_recalc (EV_A_ w);
     }
   else
-    ev_at (w) = w->offset;
+    ev_at (w) = EV_LT (w->offset);
 
   EV_FREQUENT_CHECK;
 
   ++periodiccnt;
   ev_start (EV_A_ (W)w, periodiccnt + HEAP0 - 1);
-  array_needsize (ANHE, periodics, periodicmax, ev_active (w) + 1, EMPTY2);
-  ANHE_w (periodics [ev_active (w)]) = (WT)w;
-  ANHE_at_cache (periodics [ev_active (w)]);
+  heap_needsize (periodics, periodicmax, ev_active (w) + 1);
+  HE_w (periodics, ev_active (w)) = (WT)w;
+  HE_at_cache (periodics, ev_active (w));
   upheap (periodics, ev_active (w));
 
   EV_FREQUENT_CHECK;
 
-  /*assert (("libev: internal periodic heap corruption", ANHE_w (periodics [ev_active (w)]) == (WT)w));*/
+  /*assert (("libev: internal periodic heap corruption", HE_w (periodics, ev_active (w)) == (WT)w));*/
 }
 
 void noinline
@@ -3686,15 +4255,18 @@ ev_periodic_stop (EV_P_ ev_periodic *w) EV_THROW
   {
     int active = ev_active (w);
 
-    assert (("libev: internal periodic heap corruption", ANHE_w (periodics [active]) == (WT)w));
+    assert (("libev: internal periodic heap corruption", HE_w (periodics, active) == (WT)w));
 
     --periodiccnt;
 
     if (expect_true (active < periodiccnt + HEAP0))
       {
-        periodics [active] = periodics [periodiccnt + HEAP0];
+        HE_move (periodics, active, periodiccnt + HEAP0);
+        HE_clear (periodics, periodiccnt + HEAP0);
         adjustheap (periodics, periodiccnt, active);
       }
+    else
+      HE_clear (periodics, active);
   }
 
   ev_stop (EV_A_ (W)w);
@@ -4012,6 +4584,9 @@ infy_cb (EV_P_ ev_io *w, int revents)
   int ofs;
   int len = read (fs_fd, buf, sizeof (buf));
 
+  if (len < (int)sizeof (buf))
+    ev_io_drained (EV_A_ w, EV_READ);
+
   for (ofs = 0; ofs < len; )
     {
       struct inotify_event *ev = (struct inotify_event *)(buf + ofs);
@@ -4691,20 +5266,34 @@ ev_walk (EV_P_ int types, void (*cb)(EV_P_ int type, void *w)) EV_THROW
     for (i = timercnt + HEAP0; i-- > HEAP0; )
 #if EV_STAT_ENABLE
       /*TODO: timer is not always active*/
-      if (ev_cb ((ev_timer *)ANHE_w (timers [i])) == stat_timer_cb)
+      if (ev_cb ((ev_timer *)HE_w (timers, i)) == stat_timer_cb)
         {
           if (types & EV_STAT)
-            cb (EV_A_ EV_STAT, ((char *)ANHE_w (timers [i])) - offsetof (struct ev_stat, timer));
+            cb (EV_A_ EV_STAT, ((char *)HE_w (timers, i)) - offsetof (struct ev_stat, timer));
         }
       else
 #endif
       if (types & EV_TIMER)
-        cb (EV_A_ EV_TIMER, ANHE_w (timers [i]));
+        cb (EV_A_ EV_TIMER, HE_w (timers, i));
+
+  if (types & (EV_TIMER | EV_STAT))
+    for (i = wheel_nodecnt; i-- > 1; )
+      if (!wheel_nodes [i].w)
+        continue;
+#if EV_STAT_ENABLE
+      else if (ev_cb ((ev_timer *)wheel_nodes [i].w) == stat_timer_cb)
+        {
+          if (types & EV_STAT)
+            cb (EV_A_ EV_STAT, ((char *)wheel_nodes [i].w) - offsetof (struct ev_stat, timer));
+        }
+#endif
+      else if (types & EV_TIMER)
+        cb (EV_A_ EV_TIMER, wheel_nodes [i].w);
 
 #if EV_PERIODIC_ENABLE
   if (types & EV_PERIODIC)
     for (i = periodiccnt + HEAP0; i-- > HEAP0; )
-      cb (EV_A_ EV_PERIODIC, ANHE_w (periodics [i]));
+      cb (EV_A_ EV_PERIODIC, HE_w (periodics, i));
 #endif
 
 #if EV_IDLE_ENABLE
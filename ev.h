@@ -148,6 +148,23 @@ EV_CPP(extern "C" {)
 
 typedef double ev_tstamp;
 
+/* with EV_TIME_NS, a loop keeps its monotonic time and the times of its */
+/* timers and periodics in integer nanoseconds instead of ev_tstamp */
+#ifndef EV_TIME_NS
+# define EV_TIME_NS 0
+#endif
+
+#if EV_TIME_NS
+# include <stdint.h>
+typedef int64_t ev_ltime;
+# define EV_LT(ts)    ((ev_ltime)((ts) * 1e9)) /* ev_tstamp to ev_ltime */
+# define EV_LT_TS(lt) ((ev_tstamp)(lt) * 1e-9) /* and back */
+#else
+typedef ev_tstamp ev_ltime;
+# define EV_LT(ts)    (ts)
+# define EV_LT_TS(lt) (lt)
+#endif
+
 #ifndef EV_ATOMIC_T
 # include <signal.h>
 # define EV_ATOMIC_T sig_atomic_t volatile
@@ -286,7 +303,7 @@ enum {
 
 #define EV_WATCHER_TIME(type)			\
   EV_WATCHER (type)				\
-  ev_tstamp at;     /* private */
+  ev_ltime at;      /* private */
 
 /* base class, nothing to see here unless you subclass */
 typedef struct ev_watcher
@@ -504,7 +521,10 @@ enum {
   EVFLAG_NOSIGFD   = 0, /* compatibility to pre-3.9 */
 #endif
   EVFLAG_SIGNALFD  = 0x00200000U, /* attempt to use signalfd */
-  EVFLAG_NOSIGMASK = 0x00400000U  /* avoid modifying the signal mask */
+  EVFLAG_NOSIGMASK = 0x00400000U, /* avoid modifying the signal mask */
+  /* zpv's own flags, on bits upstream libev does not use (it has 0x00800000U as EVFLAG_NOTIMERFD) */
+  EVFLAG_STICKY    = 0x08000000U, /* epoll: keep fds registered edge-triggered, see ev_io_drained */
+  EVFLAG_TIMERWHEEL = 0x04000000U  /* keep longer timers on a timing wheel, see EV_WHEEL_MIN */
 };
 
 /* method bits to be ored together */
@@ -515,7 +535,8 @@ enum {
   EVBACKEND_KQUEUE  = 0x00000008U, /* bsd */
   EVBACKEND_DEVPOLL = 0x00000010U, /* solaris 8 */ /* NYI */
   EVBACKEND_PORT    = 0x00000020U, /* solaris 10 */
-  EVBACKEND_ALL     = 0x0000003FU, /* all known backends */
+  EVBACKEND_IOURING = 0x00000080U, /* linux >= 5.1 */
+  EVBACKEND_ALL     = 0x000000BFU, /* all known backends */
   EVBACKEND_MASK    = 0x0000FFFFU  /* all future backends */
 };
 
@@ -683,7 +704,7 @@ EV_API_DECL void ev_resume  (EV_P) EV_THROW;
 } while (0)
 
 #define ev_io_set(ev,fd_,events_)            do { (ev)->fd = (fd_); (ev)->events = (events_) | EV__IOFDSET; } while (0)
-#define ev_timer_set(ev,after_,repeat_)      do { ((ev_watcher_time *)(ev))->at = (after_); (ev)->repeat = (repeat_); } while (0)
+#define ev_timer_set(ev,after_,repeat_)      do { ((ev_watcher_time *)(ev))->at = EV_LT (after_); (ev)->repeat = (repeat_); } while (0)
 #define ev_periodic_set(ev,ofs_,ival_,rcb_)  do { (ev)->offset = (ofs_); (ev)->interval = (ival_); (ev)->reschedule_cb = (rcb_); } while (0)
 #define ev_signal_set(ev,signum_)            do { (ev)->signum = (signum_); } while (0)
 #define ev_child_set(ev,pid_,trace_)         do { (ev)->pid = (pid_); (ev)->flags = !!(trace_); } while (0)
@@ -723,7 +744,7 @@ EV_API_DECL void ev_resume  (EV_P) EV_THROW;
 # define ev_set_priority(ev,pri)             (   (ev_watcher *)(void *)(ev))->priority = (pri)
 #endif
 
-#define ev_periodic_at(ev)                   (+((ev_watcher_time *)(ev))->at)
+#define ev_periodic_at(ev)                   (+EV_LT_TS (((ev_watcher_time *)(ev))->at))
 
 #ifndef ev_set_cb
 # define ev_set_cb(ev,cb_)                   ev_cb (ev) = (cb_)
@@ -737,6 +758,9 @@ EV_API_DECL void ev_resume  (EV_P) EV_THROW;
 /* accepts any ev_watcher type */
 EV_API_DECL void ev_feed_event     (EV_P_ void *w, int revents) EV_THROW;
 EV_API_DECL void ev_feed_fd_event  (EV_P_ int fd, int revents) EV_THROW;
+/* with EVFLAG_STICKY, an fd stays ready until its reads (EV_READ) or writes */
+/* (EV_WRITE) have failed with EAGAIN, which the callback reports here */
+EV_API_DECL void ev_io_drained     (EV_P_ ev_io *w, int revents) EV_THROW;
 #if EV_SIGNAL_ENABLE
 EV_API_DECL void ev_feed_signal    (int signum) EV_THROW;
 EV_API_DECL void ev_feed_signal_event (EV_P_ int signum) EV_THROW;
@@ -64,15 +64,127 @@
  */
 
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#if EV_USE_TIMERFD
+# include <sys/timerfd.h>
+#endif
 
 #define EV_EMASK_EPERM 0x80
 
+/*
+ * epoll_wait takes its timeout in milliseconds, so a timer is woken up to
+ * a millisecond late. epoll_pwait2 (linux 5.11) takes a timespec instead.
+ * without it, a timerfd in the epoll set is armed to the timeout before
+ * every wait that blocks, and the millisecond timeout rounded up is only
+ * the backstop. arming it again also resets it, so it never needs to be
+ * disarmed or read.
+ */
+#define EV_EPOLL_TIMERFD ((uint64_t)-1) /* data of the timerfd, never an fd and generation */
+
+#ifdef SYS_epoll_pwait2
+inline_size int
+evsys_epoll_pwait2 (int epfd, struct epoll_event *events, int maxevents, const struct timespec *timeout)
+{
+  return syscall (SYS_epoll_pwait2, epfd, events, maxevents, timeout, 0, 0);
+}
+#endif
+
+/* the fallback without epoll_pwait2 */
+static void
+epoll_timerfd_init (EV_P)
+{
+  epoll_timerfd = -1;
+
+#if EV_USE_TIMERFD
+  epoll_timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (epoll_timerfd >= 0)
+    {
+      struct epoll_event ev;
+
+      ev.events   = EPOLLIN;
+      ev.data.u64 = EV_EPOLL_TIMERFD;
+
+      if (epoll_ctl (backend_fd, EPOLL_CTL_ADD, epoll_timerfd, &ev))
+        {
+          close (epoll_timerfd);
+          epoll_timerfd = -1;
+        }
+    }
+#endif
+}
+
+/* pick how the waits get their precision, once the epoll fd exists */
+static void
+epoll_timeout_init (EV_P)
+{
+  epoll_timespec = 0;
+  epoll_timerfd  = -1;
+
+#ifdef SYS_epoll_pwait2
+  {
+    struct timespec ts = { 0, 0 };
+
+    if (evsys_epoll_pwait2 (backend_fd, epoll_events, epoll_eventmax, &ts) >= 0)
+      {
+        epoll_timespec = 1;
+        return;
+      }
+  }
+#endif
+
+  epoll_timerfd_init (EV_A);
+}
+
+/*
+ * with EVFLAG_STICKY, an fd is registered once, edge-triggered for both
+ * directions, and stays registered while its watchers are started and
+ * stopped, which then costs no epoll_ctl at all. edges are collected in
+ * anfds [fd].eready, and an fd counts as ready until the application
+ * reports with ev_io_drained that it got EAGAIN. the fds with readiness
+ * left are kept in epoll_readys, and their events are delivered from there
+ * whenever a watcher wants them, so readiness survives a stopped watcher.
+ */
+static void
+epoll_ready (EV_P_ int fd, int events)
+{
+  if (!anfds [fd].eready)
+    {
+      array_needsize (int, epoll_readys, epoll_readymax, epoll_readycnt + 1, EMPTY2);
+      epoll_readys [epoll_readycnt++] = fd;
+    }
+
+  anfds [fd].eready |= events;
+}
+
 static void
 epoll_modify (EV_P_ int fd, int oev, int nev)
 {
   struct epoll_event ev;
   unsigned char oldmask;
 
+  if (epoll_sticky && !(anfds [fd].emask & EV_EMASK_EPERM))
+    {
+      if (!nev || anfds [fd].emask & EV_EMASK_STICKY)
+        return;
+
+      ev.data.u64 = (uint64_t)(uint32_t)fd
+                  | ((uint64_t)(uint32_t)++anfds [fd].egen << 32);
+      ev.events   = EPOLLIN | EPOLLOUT | EPOLLET;
+
+      /* the kernel reports the current readiness as the first edge */
+      if (!epoll_ctl (backend_fd, EPOLL_CTL_ADD, fd, &ev)
+          || (errno == EEXIST && !epoll_ctl (backend_fd, EPOLL_CTL_MOD, fd, &ev)))
+        {
+          anfds [fd].emask  = EV_EMASK_STICKY | EV_READ | EV_WRITE;
+          anfds [fd].eready = 0;
+          return;
+        }
+
+      /* e.g. EPERM for regular files, handle it as usual */
+      --anfds [fd].egen;
+    }
+
   /*
    * we handle EPOLL_CTL_DEL by ignoring it here
    * on the assumption that the fd is gone anyways
@@ -147,10 +259,37 @@ epoll_poll (EV_P_ ev_tstamp timeout)
   if (expect_false (epoll_epermcnt))
     timeout = 0.;
 
-  /* epoll wait times cannot be larger than (LONG_MAX - 999UL) / HZ msecs, which is below */
-  /* the default libev max wait time, however. */
+  /* do not wait while a sticky fd has events a watcher wants */
+  for (i = epoll_readycnt; i-- && timeout; )
+    if (anfds [epoll_readys [i]].eready & anfds [epoll_readys [i]].events)
+      timeout = 0.;
+
   EV_RELEASE_CB;
-  eventcnt = epoll_wait (backend_fd, epoll_events, epoll_eventmax, timeout * 1e3);
+#ifdef SYS_epoll_pwait2
+  if (expect_true (epoll_timespec))
+    {
+      struct timespec ts;
+
+      EV_TS_SET (ts, timeout);
+      eventcnt = evsys_epoll_pwait2 (backend_fd, epoll_events, epoll_eventmax, &ts);
+    }
+  else
+#endif
+    {
+#if EV_USE_TIMERFD
+      if (epoll_timerfd >= 0 && timeout > 0.)
+        {
+          struct itimerspec its = { { 0, 0 } };
+
+          EV_TS_SET (its.it_value, timeout);
+          timerfd_settime (epoll_timerfd, 0, &its, 0);
+        }
+#endif
+
+      /* epoll wait times cannot be larger than (LONG_MAX - 999UL) / HZ msecs, which is below */
+      /* the default libev max wait time, however. */
+      eventcnt = epoll_wait (backend_fd, epoll_events, epoll_eventmax, EV_TS_TO_MSEC (timeout));
+    }
   EV_ACQUIRE_CB;
 
   if (expect_false (eventcnt < 0))
@@ -166,6 +305,11 @@ epoll_poll (EV_P_ ev_tstamp timeout)
       struct epoll_event *ev = epoll_events + i;
 
       int fd = (uint32_t)ev->data.u64; /* mask out the lower 32 bits */
+
+      /* the timerfd only ends the wait */
+      if (expect_false (ev->data.u64 == EV_EPOLL_TIMERFD))
+        continue;
+
       int want = anfds [fd].events;
       int got  = (ev->events & (EPOLLOUT | EPOLLERR | EPOLLHUP) ? EV_WRITE : 0)
                | (ev->events & (EPOLLIN  | EPOLLERR | EPOLLHUP) ? EV_READ  : 0);
@@ -183,6 +327,12 @@ epoll_poll (EV_P_ ev_tstamp timeout)
           continue;
         }
 
+      if (anfds [fd].emask & EV_EMASK_STICKY)
+        {
+          epoll_ready (EV_A_ fd, got);
+          continue;
+        }
+
       if (expect_false (got & ~want))
         {
           anfds [fd].emask = want;
@@ -219,6 +369,18 @@ epoll_poll (EV_P_ ev_tstamp timeout)
       epoll_events = (struct epoll_event *)ev_malloc (sizeof (struct epoll_event) * epoll_eventmax);
     }
 
+  /* deliver what the sticky fds have left that is wanted, forget the drained ones */
+  for (i = epoll_readycnt; i--; )
+    {
+      int fd = epoll_readys [i];
+      unsigned char events = anfds [fd].eready & anfds [fd].events;
+
+      if (!anfds [fd].eready)
+        epoll_readys [i] = epoll_readys [--epoll_readycnt];
+      else if (events)
+        fd_event (EV_A_ fd, events);
+    }
+
   /* now synthesize events for all fds where epoll fails, while select works... */
   for (i = epoll_epermcnt; i--; )
     {
@@ -228,7 +390,10 @@ epoll_poll (EV_P_ ev_tstamp timeout)
       if (anfds [fd].emask & EV_EMASK_EPERM && events)
         fd_event (EV_A_ fd, events);
       else
-        epoll_eperms [i] = epoll_eperms [--epoll_epermcnt];
+        {
+          epoll_eperms [i] = epoll_eperms [--epoll_epermcnt];
+          anfds [fd].emask = 0;
+        }
     }
 }
 
@@ -247,13 +412,18 @@ epoll_init (EV_P_ int flags)
 
   fcntl (backend_fd, F_SETFD, FD_CLOEXEC);
 
-  backend_mintime = 1e-3; /* epoll does sometimes return early, this is just to avoid the worst */
+  epoll_sticky    = !!(flags & EVFLAG_STICKY);
   backend_modify  = epoll_modify;
   backend_poll    = epoll_poll;
 
   epoll_eventmax = 64; /* initial number of events receivable per poll */
   epoll_events = (struct epoll_event *)ev_malloc (sizeof (struct epoll_event) * epoll_eventmax);
 
+  epoll_timeout_init (EV_A);
+
+  /* epoll does sometimes return early, this is just to avoid the worst */
+  backend_mintime = epoll_timespec || epoll_timerfd >= 0 ? 1e-6 : 1e-3;
+
   return EVBACKEND_EPOLL;
 }
 
@@ -262,6 +432,10 @@ epoll_destroy (EV_P)
 {
   ev_free (epoll_events);
   array_free (epoll_eperm, EMPTY);
+  array_free (epoll_ready, EMPTY);
+
+  if (epoll_timerfd >= 0)
+    close (epoll_timerfd);
 }
 
 void inline_size
@@ -274,6 +448,12 @@ epoll_fork (EV_P)
 
   fcntl (backend_fd, F_SETFD, FD_CLOEXEC);
 
+  /* the timerfd is shared with the parent, so make our own */
+  if (epoll_timerfd >= 0)
+    close (epoll_timerfd);
+
+  epoll_timeout_init (EV_A);
+
   fd_rearm_all (EV_A);
 }
 
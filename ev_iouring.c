@@ -0,0 +1,412 @@
+/*
+ * libev linux io_uring fd activity backend
+ *
+ * Copyright (c) 2007,2008,2009,2010,2011 Marc Alexander Lehmann <libev@schmorp.de>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modifica-
+ * tion, are permitted provided that the following conditions are met:
+ *
+ *   1.  Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *   2.  Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MER-
+ * CHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPE-
+ * CIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTH-
+ * ERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * the GNU General Public License ("GPL") version 2 or any later version,
+ * in which case the provisions of the GPL are applicable instead of
+ * the above. If you wish to allow the use of your version of this file
+ * only under the terms of the GPL and not to allow others to use your
+ * version of this file under the BSD license, indicate your decision
+ * by deleting the provisions above and replace them with the notice
+ * and other provisions required by the GPL. If you do not delete the
+ * provisions above, a recipient may use your version of this file under
+ * either the BSD or the GPL.
+ */
+
+/*
+ * general notes about io_uring:
+ *
+ * a) poll requests are oneshot: once a request completes, it is gone, and
+ *    the fd has to be re-armed before it can report again. we do this by
+ *    clearing anfds [fd].events and queueing the fd for reification, so
+ *    fd_reify submits a fresh request on the next iteration.
+ * b) interest changes (fd_reify -> iouring_modify) only queue submission
+ *    queue entries in user space. all of them, plus the wait itself, are
+ *    handed to the kernel with a single io_uring_enter per iteration,
+ *    instead of one epoll_ctl per change.
+ * c) requests and their completions are matched by user_data, which holds
+ *    the fd in the lower and the generation counter in the upper 32 bits,
+ *    just like the epoll backend. completions for stale generations (i.e.
+ *    removed or replaced requests) are ignored.
+ * d) we talk to the kernel directly, as liburing is not always available.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+#define EV_IOURING_ENTRIES 256 /* submission queue size, the completion queue is larger */
+#define EV_IOURING_IGNORE ((__u64)-1) /* user_data of requests whose completions we ignore */
+
+/* the rings are shared with the kernel, which updates them concurrently */
+#define EV_IOURING_LOAD(v)    __atomic_load_n (&(v), __ATOMIC_ACQUIRE)
+#define EV_IOURING_STORE(v,n) __atomic_store_n (&(v), (n), __ATOMIC_RELEASE)
+
+#define EV_SQ_VAR(name) *(unsigned *)((char *)iouring_sq_ring + iouring_sq_ ## name)
+#define EV_CQ_VAR(name) *(unsigned *)((char *)iouring_cq_ring + iouring_cq_ ## name)
+#define EV_SQ_ARRAY     ((unsigned *)((char *)iouring_sq_ring + iouring_sq_array))
+#define EV_CQES         ((struct io_uring_cqe *)((char *)iouring_cq_ring + iouring_cq_cqes))
+#define EV_SQES         ((struct io_uring_sqe *)iouring_sqes)
+
+inline_size int
+evsys_io_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+  return syscall (SYS_io_uring_setup, entries, params);
+}
+
+inline_size int
+evsys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+  return syscall (SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int iouring_enter (EV_P_ ev_tstamp timeout);
+
+static struct io_uring_sqe *
+iouring_sqe_get (EV_P)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail;
+
+  for (;;)
+    {
+      tail = EV_SQ_VAR (tail);
+
+      if (expect_true (tail + 1 - EV_IOURING_LOAD (EV_SQ_VAR (head)) <= EV_SQ_VAR (ring_entries)))
+        break;
+
+      /* submission queue full, hand what we have to the kernel */
+      if (iouring_enter (EV_A_ 0.) < 0 && errno != EINTR && errno != EBUSY)
+        ev_syserr ("(libev) io_uring_enter");
+    }
+
+  sqe = EV_SQES + (tail & EV_SQ_VAR (ring_mask));
+  memset (sqe, 0, sizeof (*sqe));
+
+  return sqe;
+}
+
+inline_size void
+iouring_sqe_submit (EV_P_ struct io_uring_sqe *sqe)
+{
+  unsigned idx = sqe - EV_SQES;
+
+  EV_SQ_ARRAY [idx] = idx;
+  EV_IOURING_STORE (EV_SQ_VAR (tail), EV_SQ_VAR (tail) + 1);
+  ++iouring_to_submit;
+}
+
+/* submit all queued requests and wait up to timeout for a completion */
+static int
+iouring_enter (EV_P_ ev_tstamp timeout)
+{
+  int res;
+  unsigned min_complete = 0;
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  const void *argp = 0;
+  size_t argsz = 0;
+
+  if (timeout > 0.)
+    {
+      min_complete = 1;
+      ts.tv_sec  = (long)timeout;
+      ts.tv_nsec = (long)((timeout - (ev_tstamp)ts.tv_sec) * 1e9);
+
+      if (iouring_features & IORING_FEAT_EXT_ARG)
+        {
+          memset (&arg, 0, sizeof (arg));
+          arg.ts = (__u64)(uintptr_t)&ts;
+          argp   = &arg;
+          argsz  = sizeof (arg);
+          flags |= IORING_ENTER_EXT_ARG;
+        }
+      else
+        {
+          /* older kernels: a timeout request that completes after one other completion or the timeout */
+          struct io_uring_sqe *sqe = iouring_sqe_get (EV_A);
+
+          sqe->opcode    = IORING_OP_TIMEOUT;
+          sqe->addr      = (__u64)(uintptr_t)&ts;
+          sqe->len       = 1;
+          sqe->off       = 1;
+          sqe->user_data = EV_IOURING_IGNORE;
+          iouring_sqe_submit (EV_A_ sqe);
+        }
+    }
+
+  EV_RELEASE_CB;
+  res = evsys_io_uring_enter (backend_fd, iouring_to_submit, min_complete, flags, argp, argsz);
+  EV_ACQUIRE_CB;
+
+  if (res >= 0)
+    iouring_to_submit -= res;
+  else if (errno == ETIME)
+    {
+      /* the wait timed out, but everything was submitted */
+      iouring_to_submit = 0;
+      res = 0;
+    }
+
+  return res;
+}
+
+static void
+iouring_modify (EV_P_ int fd, int oev, int nev)
+{
+  struct io_uring_sqe *sqe;
+
+  if (oev)
+    {
+      /* cancel the old request, identified by its user_data */
+      sqe = iouring_sqe_get (EV_A);
+      sqe->opcode    = IORING_OP_POLL_REMOVE;
+      sqe->fd        = fd;
+      sqe->addr      = (uint32_t)fd | ((__u64)(uint32_t)anfds [fd].egen << 32);
+      sqe->user_data = EV_IOURING_IGNORE;
+      iouring_sqe_submit (EV_A_ sqe);
+
+      /* its completion, if still in flight, is stale from now on */
+      ++anfds [fd].egen;
+    }
+
+  if (nev)
+    {
+      sqe = iouring_sqe_get (EV_A);
+      sqe->opcode      = IORING_OP_POLL_ADD;
+      sqe->fd          = fd;
+      sqe->poll_events = (nev & EV_READ  ? POLLIN  : 0)
+                       | (nev & EV_WRITE ? POLLOUT : 0);
+      sqe->user_data   = (uint32_t)fd | ((__u64)(uint32_t)anfds [fd].egen << 32);
+      iouring_sqe_submit (EV_A_ sqe);
+    }
+}
+
+inline_size void
+iouring_process_cqe (EV_P_ struct io_uring_cqe *cqe)
+{
+  int fd  = cqe->user_data & 0xffffffffU;
+  int res = cqe->res;
+
+  if (cqe->user_data == EV_IOURING_IGNORE)
+    return;
+
+  assert (("libev: io_uring fd must be in-bounds", fd >= 0 && fd < anfdmax));
+
+  if (expect_false ((uint32_t)anfds [fd].egen != (uint32_t)(cqe->user_data >> 32)))
+    return;
+
+  if (expect_false (res < 0))
+    {
+      if (res == -EBADF)
+        fd_kill (EV_A_ fd);
+      else
+        {
+          errno = -res;
+          ev_syserr ("(libev) IORING_OP_POLL_ADD");
+        }
+
+      return;
+    }
+
+  fd_event (
+    EV_A_
+    fd,
+    (res & (POLLOUT | POLLERR | POLLHUP) ? EV_WRITE : 0)
+    | (res & (POLLIN | POLLERR | POLLHUP) ? EV_READ : 0)
+  );
+
+  /* the request is gone, have fd_reify submit a new one if still wanted */
+  anfds [fd].events = 0;
+  fd_change (EV_A_ fd, EV_ANFD_REIFY);
+}
+
+/* returns true if any completions were reaped */
+static int
+iouring_handle_cq (EV_P)
+{
+  unsigned head, tail, mask;
+  int found = 0;
+
+  for (;;)
+    {
+      head = EV_CQ_VAR (head);
+      tail = EV_IOURING_LOAD (EV_CQ_VAR (tail));
+      mask = EV_CQ_VAR (ring_mask);
+
+      if (head != tail)
+        {
+          found = 1;
+
+          do
+            iouring_process_cqe (EV_A_ &EV_CQES [head++ & mask]);
+          while (head != tail);
+
+          EV_IOURING_STORE (EV_CQ_VAR (head), head);
+        }
+
+      /* the kernel keeps completions that did not fit back, ask for them */
+      if (expect_true (!(EV_IOURING_LOAD (EV_SQ_VAR (flags)) & IORING_SQ_CQ_OVERFLOW)))
+        break;
+
+      if (evsys_io_uring_enter (backend_fd, 0, 0, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+        ev_syserr ("(libev) io_uring_enter");
+    }
+
+  return found;
+}
+
+static void
+iouring_poll (EV_P_ ev_tstamp timeout)
+{
+  /* completions left over from flushing a full submission queue must not wait */
+  if (iouring_handle_cq (EV_A))
+    timeout = 0.;
+
+  /* only enter the kernel if we have something to submit or need to wait */
+  if (timeout > 0. || iouring_to_submit)
+    {
+      if (expect_false (iouring_enter (EV_A_ timeout) < 0))
+        {
+          if (errno != EINTR && errno != EBUSY)
+            ev_syserr ("(libev) io_uring_enter");
+        }
+      else
+        iouring_handle_cq (EV_A);
+    }
+}
+
+inline_size int
+iouring_internal_init (EV_P)
+{
+  struct io_uring_params params;
+
+  memset (&params, 0, sizeof (params));
+  params.flags      = IORING_SETUP_CQSIZE;
+  params.cq_entries = EV_IOURING_ENTRIES * 4;
+
+  iouring_to_submit = 0;
+  iouring_sq_ring   = MAP_FAILED;
+  iouring_cq_ring   = MAP_FAILED;
+  iouring_sqes      = MAP_FAILED;
+
+  backend_fd = evsys_io_uring_setup (EV_IOURING_ENTRIES, &params);
+  if (backend_fd < 0)
+    return -1;
+
+  iouring_features = params.features;
+
+  iouring_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  iouring_cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof (struct io_uring_cqe);
+  iouring_sqes_size    = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  /* newer kernels map both rings with one mmap */
+  if (iouring_features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (iouring_cq_ring_size > iouring_sq_ring_size)
+        iouring_sq_ring_size = iouring_cq_ring_size;
+
+      iouring_cq_ring_size = iouring_sq_ring_size;
+    }
+
+  iouring_sq_ring = mmap (0, iouring_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_SQ_RING);
+  iouring_cq_ring = iouring_features & IORING_FEAT_SINGLE_MMAP
+                    ? iouring_sq_ring
+                    : mmap (0, iouring_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_CQ_RING);
+  iouring_sqes    = mmap (0, iouring_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, backend_fd, IORING_OFF_SQES);
+
+  if (iouring_sq_ring == MAP_FAILED || iouring_cq_ring == MAP_FAILED || iouring_sqes == MAP_FAILED)
+    return -1;
+
+  iouring_sq_head         = params.sq_off.head;
+  iouring_sq_tail         = params.sq_off.tail;
+  iouring_sq_ring_mask    = params.sq_off.ring_mask;
+  iouring_sq_ring_entries = params.sq_off.ring_entries;
+  iouring_sq_flags        = params.sq_off.flags;
+  iouring_sq_array        = params.sq_off.array;
+
+  iouring_cq_head         = params.cq_off.head;
+  iouring_cq_tail         = params.cq_off.tail;
+  iouring_cq_ring_mask    = params.cq_off.ring_mask;
+  iouring_cq_cqes         = params.cq_off.cqes;
+
+  fcntl (backend_fd, F_SETFD, FD_CLOEXEC);
+
+  return 0;
+}
+
+inline_size void
+iouring_internal_destroy (EV_P)
+{
+  if (iouring_cq_ring != MAP_FAILED && iouring_cq_ring != iouring_sq_ring)
+    munmap (iouring_cq_ring, iouring_cq_ring_size);
+  if (iouring_sq_ring != MAP_FAILED) munmap (iouring_sq_ring, iouring_sq_ring_size);
+  if (iouring_sqes    != MAP_FAILED) munmap (iouring_sqes   , iouring_sqes_size   );
+
+  iouring_sq_ring = iouring_cq_ring = iouring_sqes = MAP_FAILED;
+}
+
+int inline_size
+iouring_init (EV_P_ int flags)
+{
+  if (iouring_internal_init (EV_A) < 0)
+    {
+      iouring_internal_destroy (EV_A);
+
+      if (backend_fd >= 0)
+        close (backend_fd);
+
+      backend_fd = -1;
+      return 0;
+    }
+
+  backend_mintime = 1e-6; /* timeouts are passed to the kernel as timespec */
+  backend_modify  = iouring_modify;
+  backend_poll    = iouring_poll;
+
+  return EVBACKEND_IOURING;
+}
+
+void inline_size
+iouring_destroy (EV_P)
+{
+  iouring_internal_destroy (EV_A);
+}
+
+void inline_size
+iouring_fork (EV_P)
+{
+  iouring_internal_destroy (EV_A);
+  close (backend_fd);
+
+  while (iouring_internal_init (EV_A) < 0)
+    ev_syserr ("(libev) io_uring_setup");
+
+  fd_rearm_all (EV_A);
+}
@@ -39,8 +39,8 @@
 
 #define VARx(type,name) VAR(name, type name)
 
-VARx(ev_tstamp, now_floor) /* last time we refreshed rt_time */
-VARx(ev_tstamp, mn_now)    /* monotonic clock "now" */
+VARx(ev_ltime, now_floor) /* last time we refreshed rt_time */
+VARx(ev_ltime, mn_now)    /* monotonic clock "now" */
 VARx(ev_tstamp, rtmn_diff) /* difference realtime - monotonic time */
 
 /* for reverse feeding of events */
@@ -105,6 +105,33 @@ VARx(int, epoll_eventmax)
 VARx(int *, epoll_eperms)
 VARx(int, epoll_epermcnt)
 VARx(int, epoll_epermmax)
+VARx(int, epoll_sticky) /* EVFLAG_STICKY */
+VARx(int *, epoll_readys) /* sticky fds with eready set */
+VARx(int, epoll_readycnt)
+VARx(int, epoll_readymax)
+VARx(int, epoll_timespec) /* epoll_pwait2 works */
+VARx(int, epoll_timerfd) /* otherwise a timerfd in the set, or -1 */
+#endif
+
+#if EV_USE_IOURING || EV_GENWRAP
+VARx(unsigned, iouring_features)
+VARx(unsigned, iouring_to_submit) /* queued submission queue entries */
+VARx(void *, iouring_sq_ring)
+VARx(void *, iouring_cq_ring)
+VARx(void *, iouring_sqes)
+VARx(size_t, iouring_sq_ring_size)
+VARx(size_t, iouring_cq_ring_size)
+VARx(size_t, iouring_sqes_size)
+VARx(unsigned, iouring_sq_head)
+VARx(unsigned, iouring_sq_tail)
+VARx(unsigned, iouring_sq_ring_mask)
+VARx(unsigned, iouring_sq_ring_entries)
+VARx(unsigned, iouring_sq_flags)
+VARx(unsigned, iouring_sq_array)
+VARx(unsigned, iouring_cq_head)
+VARx(unsigned, iouring_cq_tail)
+VARx(unsigned, iouring_cq_ring_mask)
+VARx(unsigned, iouring_cq_cqes)
 #endif
 
 #if EV_USE_KQUEUE || EV_GENWRAP
@@ -133,6 +160,16 @@ VARx(ANHE *, timers)
 VARx(int, timermax)
 VARx(int, timercnt)
 
+VARx(int, wheel_enabled) /* EVFLAG_TIMERWHEEL */
+VARx(ANWHEEL *, wheel_nodes) /* [0] is unused, so that 0 ends a list */
+VARx(int, wheel_nodemax)
+VARx(int, wheel_nodecnt)
+VARx(int, wheel_free) /* list of unused nodes */
+VARx(int, wheel_count) /* timers on the wheel */
+VARx(int64_t, wheel_tick) /* the next tick to turn to */
+VAR (wheel_slots, int wheel_slots [EV_WHEEL_LEVELS * EV_WHEEL_SLOTS])
+VAR (wheel_bits, uint32_t wheel_bits [EV_WHEEL_LEVELS * EV_WHEEL_SLOTS / 32]) /* slots in use */
+
 #if EV_PERIODIC_ENABLE || EV_GENWRAP
 VARx(ANHE *, periodics)
 VARx(int, periodicmax)
@@ -26,6 +26,12 @@
 #define epoll_eperms ((loop)->epoll_eperms)
 #define epoll_eventmax ((loop)->epoll_eventmax)
 #define epoll_events ((loop)->epoll_events)
+#define epoll_readycnt ((loop)->epoll_readycnt)
+#define epoll_readymax ((loop)->epoll_readymax)
+#define epoll_readys ((loop)->epoll_readys)
+#define epoll_sticky ((loop)->epoll_sticky)
+#define epoll_timerfd ((loop)->epoll_timerfd)
+#define epoll_timespec ((loop)->epoll_timespec)
 #define evpipe ((loop)->evpipe)
 #define fdchangecnt ((loop)->fdchangecnt)
 #define fdchangemax ((loop)->fdchangemax)
@@ -44,6 +50,24 @@
 #define invoke_cb ((loop)->invoke_cb)
 #define io_blocktime ((loop)->io_blocktime)
 #define iocp ((loop)->iocp)
+#define iouring_cq_cqes ((loop)->iouring_cq_cqes)
+#define iouring_cq_head ((loop)->iouring_cq_head)
+#define iouring_cq_ring ((loop)->iouring_cq_ring)
+#define iouring_cq_ring_mask ((loop)->iouring_cq_ring_mask)
+#define iouring_cq_ring_size ((loop)->iouring_cq_ring_size)
+#define iouring_cq_tail ((loop)->iouring_cq_tail)
+#define iouring_features ((loop)->iouring_features)
+#define iouring_sq_array ((loop)->iouring_sq_array)
+#define iouring_sq_flags ((loop)->iouring_sq_flags)
+#define iouring_sq_head ((loop)->iouring_sq_head)
+#define iouring_sq_ring ((loop)->iouring_sq_ring)
+#define iouring_sq_ring_entries ((loop)->iouring_sq_ring_entries)
+#define iouring_sq_ring_mask ((loop)->iouring_sq_ring_mask)
+#define iouring_sq_ring_size ((loop)->iouring_sq_ring_size)
+#define iouring_sq_tail ((loop)->iouring_sq_tail)
+#define iouring_sqes ((loop)->iouring_sqes)
+#define iouring_sqes_size ((loop)->iouring_sqes_size)
+#define iouring_to_submit ((loop)->iouring_to_submit)
 #define kqueue_changecnt ((loop)->kqueue_changecnt)
 #define kqueue_changemax ((loop)->kqueue_changemax)
 #define kqueue_changes ((loop)->kqueue_changes)
@@ -98,6 +122,15 @@
 #define vec_ro ((loop)->vec_ro)
 #define vec_wi ((loop)->vec_wi)
 #define vec_wo ((loop)->vec_wo)
+#define wheel_bits ((loop)->wheel_bits)
+#define wheel_count ((loop)->wheel_count)
+#define wheel_enabled ((loop)->wheel_enabled)
+#define wheel_free ((loop)->wheel_free)
+#define wheel_nodecnt ((loop)->wheel_nodecnt)
+#define wheel_nodemax ((loop)->wheel_nodemax)
+#define wheel_nodes ((loop)->wheel_nodes)
+#define wheel_slots ((loop)->wheel_slots)
+#define wheel_tick ((loop)->wheel_tick)
 #else
 #undef EV_WRAP_H
 #undef acquire_cb
@@ -125,6 +158,12 @@
 #undef epoll_eperms
 #undef epoll_eventmax
 #undef epoll_events
+#undef epoll_readycnt
+#undef epoll_readymax
+#undef epoll_readys
+#undef epoll_sticky
+#undef epoll_timerfd
+#undef epoll_timespec
 #undef evpipe
 #undef fdchangecnt
 #undef fdchangemax
@@ -143,6 +182,24 @@
 #undef invoke_cb
 #undef io_blocktime
 #undef iocp
+#undef iouring_cq_cqes
+#undef iouring_cq_head
+#undef iouring_cq_ring
+#undef iouring_cq_ring_mask
+#undef iouring_cq_ring_size
+#undef iouring_cq_tail
+#undef iouring_features
+#undef iouring_sq_array
+#undef iouring_sq_flags
+#undef iouring_sq_head
+#undef iouring_sq_ring
+#undef iouring_sq_ring_entries
+#undef iouring_sq_ring_mask
+#undef iouring_sq_ring_size
+#undef iouring_sq_tail
+#undef iouring_sqes
+#undef iouring_sqes_size
+#undef iouring_to_submit
 #undef kqueue_changecnt
 #undef kqueue_changemax
 #undef kqueue_changes
@@ -197,4 +254,13 @@
 #undef vec_ro
 #undef vec_wi
 #undef vec_wo
+#undef wheel_bits
+#undef wheel_count
+#undef wheel_enabled
+#undef wheel_free
+#undef wheel_nodecnt
+#undef wheel_nodemax
+#undef wheel_nodes
+#undef wheel_slots
+#undef wheel_tick
 #endif
@@ -18,174 +18,3153 @@ limitations under the License.
 */
 
 #define VERSION 0.2
+#define _GNU_SOURCE
 
 ////////////////////////////////////////////////////////////////////////////////
 // #define EV_USE_EVENTFD 1
 // #define EV_USE_SELECT  1
 // #define EV_USE_POLL    1
 // #define EV_USE_EPOLL   1 // Linux Only
+// #define EV_USE_IOURING 1 // Linux Only
 // #define EV_USE_KQUEUE  1 // BSD/OSX Only
-#define EV_NO_THREADS 1
+// threaded mode wakes the loop with ev_async from the worker threads, so
+// EV_NO_THREADS must stay unset
 
 #define EV_STANDALONE  1
 #include "ev.c"
-////////////////////////////////////////////////////////////////////////////////
+#include <getopt.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include "zpv_stats.h"
+#include "zpv_hash.h"
+#include "zpv_records.h"
+#include "zpv_report.h"
+
 #define BUFFER_SIZE PIPE_BUF
+#define DEFAULT_RING_SLOTS 16
+#define DEFAULT_RING_SIZE ( DEFAULT_RING_SLOTS * 64 * 1024 )
+#define DEFAULT_PIPE_MAX ( 1024 * 1024 )
+#define TUNE_FULL_READS 4
+#define RATE_BURST 0.1 // seconds of the rate limit the input may read at once
+#define STATS_INTERVAL 0.1 // how often threaded mode publishes to the stats segment
+#define READER_RETRY 0.1 // how often -m tries again to open output FIFOs that had no reader
+#define RATE_SAMPLES 61 // one a second, enough for the 60 s window
+#define RATE_EWMA_TAU 5.0 // seconds
 struct ev_loop *loop;
-char data[BUFFER_SIZE+1];
-int data_size;
 
-#define READING 0
-#define WRITING 1
-int mode;
+// The buffer is a ring of slots. The input fills the slot at ring_head while
+// the outputs drain it from ring_tail, so reading and writing can happen at
+// the same time whenever the ring is neither empty nor full. Every output
+// keeps its own cursor, and a slot is free again once all outputs have
+// written it.
+typedef struct
+{
+    char *data;
+    int size;
+    int refs; // outputs that have not written this slot yet
+} slot_t;
+
+// Every wait is also counted, by length in microseconds, in a log-bucketed
+// histogram. Waits below HIST_SUB get a bucket each. Above that every power
+// of two is split into HIST_SUB / 2 buckets, so a bucket is never wider than
+// 1/16 of the values it holds. Waits longer than HIST_MAX_BITS allow go to
+// the last bucket.
+#define HIST_SUB_BITS 5
+#define HIST_SUB ( 1 << HIST_SUB_BITS )
+#define HIST_MAX_BITS 36 // 2^36 us, about 19 hours
+#define HIST_BUCKETS ( HIST_SUB + ( HIST_MAX_BITS - HIST_SUB_BITS ) * HIST_SUB / 2 )
 
+// The bytes moved by each successful system call are counted by their power
+// of two: bucket i holds the sizes above 2^(i-1) up to 2^i.
+#define SIZE_BUCKETS 32
+
+// The input waits while the ring is empty, an output waits while the ring is
+// full and that output has not written the oldest slot yet.
+// timer_start is negative while the pipe is not waiting.
+// In threaded mode the counters are written by the pipe's thread and read by
+// the timer on the main thread.
 typedef struct
 {
     ev_io watcher;
     ev_tstamp timer_start;
     ev_tstamp time_waiting;
+    int pipe_size; // kernel pipe capacity, 0 if the fd is not a pipe
+    int flags; // original file status flags, restored at exit
+    int64_t syscalls;
+    int64_t sizes[SIZE_BUCKETS];          // bytes per system call
+    int64_t waits[HIST_BUCKETS];          // wait lengths, counted as they end
+    int64_t waits_total[HIST_BUCKETS];    // waits as of the latest report
+    int64_t waits_interval[HIST_BUCKETS]; // waits between the last two reports
+    pthread_t thread; // threaded mode: the thread reading or writing the fd
+    int sleeping;     // threaded mode: the thread is blocked on the ring
 } pipe_t;
 
-pipe_t stdin_pipe;
-pipe_t stdout_pipe;
+typedef struct stream stream_t;
+
+// outputs[0] is the first output, stdout for a single stream. In splice mode
+// with several outputs each one is fed from its own staging pipe, filled with
+// tee(2) from splice_pipe. With only one output, stage is splice_pipe itself.
+#define MAX_OUTPUTS 64
+typedef struct
+{
+    pipe_t pipe;
+    stream_t *stream;
+    const char *name;
+    int tail;   // next slot to write
+    int count;  // slots waiting to be written
+    int offset; // bytes of the tail slot already written
+    int64_t bytes_out;
+    int stage[2];
+    int writing; // io_uring mode: a write of the tail slot is in flight
+    off_t file_pos; // file mode: the next input offset to send
+    int copy_range; // file mode: the output is a file, try copy_file_range(2)
+    int finished;   // file mode: the output has reached end of file
+    int error;   // threaded mode: errno of the write that failed
+    int no_reader; // multi-stream mode: a FIFO without a reader yet, /dev/null holds its fd
+} output_t;
+
+// One input and the outputs it is copied to. Normally zpv runs a single
+// stream from stdin to stdout. In multi-stream mode every stream has its own
+// ring and counters, and all of them share one event loop and timer.
+struct stream
+{
+    const char *id; // tags the JSON lines in multi-stream mode, NULL otherwise
+    const char *name;
+    pipe_t input;
+    output_t *outputs;
+    int output_count;
+    int no_readers; // outputs waiting for a reader, the stream starts when none are left
+
+    slot_t *ring;
+    int ring_slots;
+    int slot_size;
+    int ring_head;
+    int ring_tail;
+    int ring_count;
+
+    // Reads start at BUFFER_SIZE and grow towards slot_size while the input
+    // keeps filling them. The kernel pipes on either side are grown up to
+    // pipe_max.
+    int read_size;
+    int full_reads;
+
+    // In splice mode the slot bytes live in kernel pipes rather than in
+    // slot_t.data. The slots still record the chunk sizes, so the ring
+    // accounting is identical for both paths.
+    int use_splice;
+    int splice_pipe[2];
+
+    // In file mode the input is a regular file, which is its own buffer:
+    // every output is sent the file from its own offset with sendfile(2) or
+    // copy_file_range(2), and the ring stays unused.
+    int use_file;
+
+    // 1 while the input is open, 0 after end of file, or -errno after a read
+    // error. The ring is drained to the outputs before the stream ends either way.
+    int input_status;
+    int done;
+    int64_t bytes_in;
+    int64_t last_bytes_out; // at the previous timer tick, to detect stalls
+    int64_t size; // bytes the input will deliver, -1 if unknown
+
+    // bytes_out of the first output is sampled once a second into a ring.
+    // The windowed rates are the differences across it, and rate_ewma
+    // smooths the rate between consecutive samples.
+    int64_t rate_bytes[ RATE_SAMPLES ];
+    ev_tstamp rate_times[ RATE_SAMPLES ];
+    int rate_head; // the latest sample
+    int rate_count;
+    double rate_1s, rate_10s, rate_60s, rate_ewma;
+
+    // io_uring mode
+    int reading;     // a read of ring_head is in flight
+    int wait_writer; // the input is a FIFO that may not have a writer yet
+    int buf_base;    // index of ring[0] among the registered buffers
+    int file_base;   // index of the input among the registered files, outputs follow
+    int sq_blocked;  // found the submission queue full, retried before the loop sleeps
+
+    // With a rate limit the input reads from a token bucket of
+    // RATE_BURST * rate_limit bytes. Once it holds less than a chunk, the
+    // input is paused and the refill timer resumes it when enough is back.
+    double tokens;
+    ev_tstamp refilled;       // when tokens were last topped up
+    ev_tstamp throttle_start; // negative while not throttled
+    ev_tstamp time_throttled;
+    ev_timer refill;
+
+    zpv_stats_stream_t *stats; // -S: the stream's record in the stats segment
+
+    // -H: digests of the bytes read, updated by whoever reads into the ring
+    // while the slot is still in cache
+    uint32_t crc32c;
+    sha256_t sha256;
+
+    // -l: delimiters counted as they are read, and as of the last JSON line
+    int64_t records;
+    int64_t records_reported;
+    ev_tstamp records_time;
+
+    // threaded mode
+    int threads;  // still running
+    int stop;     // a write failed, all threads of the stream are to exit
+    int head_seq; // bumped when slots are added or the input ends, outputs sleep on it
+    int tail_seq; // bumped when a slot is freed, the input sleeps on it
+};
+
+int pipe_max;
+int64_t rate_limit; // bytes per second per stream, 0 for none
+int64_t size_hint;  // -1 to take the input size from the file
+int hashes;         // HASH_* of the digests to compute, 0 for none
+int record_delim;   // -l: the byte that ends a record, -1 to not count records
+int use_uring;
+int use_threads;
+stream_t *streams;
+int stream_count;
+int streams_active;
+int exit_status;
 ev_tstamp start_time;
 ev_timer timer;
 ev_signal exitsig;
-int64_t bytes_out;
+zpv_stats_header_t *stats;
+size_t stats_size;
+char stats_path[64];
+ev_timer stats_timer;
+ev_timer rates_timer;
+ev_timer readers_timer;
+
+// Counters shared with the threads in threaded mode. Each has a single writer.
+#define STAT(v) __atomic_load_n( &(v), __ATOMIC_RELAXED )
+#define STAT_ADD(v,n) __atomic_store_n( &(v), (v) + (n), __ATOMIC_RELAXED )
 
-static void print_timer()
+static ev_tstamp time_waiting(pipe_t *p, ev_tstamp now)
 {
-    ev_tstamp now = ev_time();
-    ev_tstamp total_time = now - start_time;
-    if ( 0 >= total_time ) return;
-    fprintf(stderr, "{ \"posix_time\": %f, \"stdin_wait_ms\": %d, \"stdout_wait_ms\": %d, \"total_time_ms\": %d, \"bytes_out\": %lld }\n", now,
-        (int)(1000 * ( stdin_pipe.time_waiting  + ( mode != READING || 0 > stdin_pipe.timer_start  ? 0 : now - stdin_pipe.timer_start ) ) ),
-        (int)(1000 * ( stdout_pipe.time_waiting + ( mode != WRITING || 0 > stdout_pipe.timer_start ? 0 : now - stdout_pipe.timer_start) ) ),
-        (int)(1000 * total_time), bytes_out );
+    ev_tstamp start, waited;
+    __atomic_load( &p->timer_start, &start, __ATOMIC_ACQUIRE );
+    __atomic_load( &p->time_waiting, &waited, __ATOMIC_RELAXED );
+    return waited + ( 0 > start ? 0 : now - start );
+}
+
+static ev_tstamp time_throttled(stream_t *s, ev_tstamp now)
+{
+    ev_tstamp start, throttled;
+    __atomic_load( &s->throttle_start, &start, __ATOMIC_ACQUIRE );
+    __atomic_load( &s->time_throttled, &throttled, __ATOMIC_RELAXED );
+    return throttled + ( 0 > start ? 0 : now - start );
 }
 
-static void stdout_callback (EV_P_ ev_io *w, int revents);
-static void stdin_callback (EV_P_ ev_io *w, int revents)
+// Every line zpv prints goes to report, which hands complete lines to
+// report_commit instead of writing stderr. The line is formatted into
+// report_line and queued in report_queue, and report_watcher writes the queue
+// to stderr without blocking, so a slow reader of stderr never holds up the
+// data. When the queue backs up, periodic reports are dropped once it is half
+// full, keeping the rest for the messages, and counted in reports_dropped.
+#define REPORT_LINE_MAX ( 64 * 1024 )
+#define REPORT_QUEUE_SIZE ( 256 * 1024 )
+#define REPORT_PREFIX sizeof( zpv_report_header_t ) // room in front of the line to frame it
+#define DEFAULT_REPORT_INTERVAL 2.0
+
+enum { REPORT_JSON, REPORT_CSV, REPORT_BINARY };
+
+FILE *report;
+int report_format;
+int report_periodic; // the report being formatted may be dropped
+int report_flags;    // original file status flags of stderr
+ev_tstamp report_interval;
+int64_t reports_dropped;
+char report_line[ REPORT_PREFIX + REPORT_LINE_MAX ];
+size_t report_line_len;
+char report_queue[ REPORT_QUEUE_SIZE ];
+size_t report_head;
+size_t report_len;
+ev_io report_watcher;
+
+// Write as much of the queue as stderr takes, and wait for it to take more
+static void report_write()
 {
-    if ( 0 == data_size )
+    ssize_t sent;
+
+    while ( report_len )
     {
-        if ( 0 >= ( data_size = read( STDIN_FILENO, &data[ 0 ], BUFFER_SIZE ) ) )
+        sent = write( STDERR_FILENO, report_queue + report_head, report_len );
+        if ( 0 > sent && EINTR == errno )
+            continue;
+        if ( 0 > sent && ( EAGAIN == errno || EWOULDBLOCK == errno ) )
         {
-            print_timer();
-            if ( 0 == data_size )
-                fprintf(stderr, "{ \"posix_time\": %f, \"exit_status\": \"Success\", \"msg\": \"End of file reached\" }\n", ev_time());
-            else
-                fprintf(stderr, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Error reading from stdin\", \"errno\": %d }\n", ev_time(), errno);
-
-            exit(data_size);
+            if ( loop )
+                ev_io_drained( loop, &report_watcher, EV_WRITE );
+            break;
         }
+        if ( 0 > sent )
+            sent = report_len; // nobody to report to
+        report_head += sent;
+        report_len -= sent;
+    }
+
+    if ( !report_len )
+        report_head = 0;
+    if ( loop && report_len )
+        ev_io_start( loop, &report_watcher );
+    else if ( loop )
+        ev_io_stop( loop, &report_watcher );
+}
+
+static void report_callback (EV_P_ ev_io *w, int revents)
+{
+    report_write();
+}
+
+// Queue size bytes to write, unless they do not fit
+static void report_add(const void *data, size_t size)
+{
+    if ( report_len + size > ( report_periodic ? REPORT_QUEUE_SIZE / 2 : REPORT_QUEUE_SIZE ) )
+    {
+        ++reports_dropped;
+        return;
+    }
+
+    if ( report_head + report_len + size > REPORT_QUEUE_SIZE )
+    {
+        memmove( report_queue, report_queue + report_head, report_len );
+        report_head = 0;
+    }
+    memcpy( report_queue + report_head + report_len, data, size );
+    report_len += size;
+}
+
+// Queue the JSON line in report_line in the report format. CSV readers skip
+// the messages as comments, binary readers get them as event records.
+static void report_commit()
+{
+    char *line = report_line + REPORT_PREFIX;
+    zpv_report_header_t header;
+
+    // a line longer than REPORT_LINE_MAX was cut short
+    if ( '\n' != line[ report_line_len - 1 ] )
+        ++reports_dropped;
+    else if ( REPORT_CSV == report_format )
+    {
+        memcpy( line - 2, "# ", 2 );
+        report_add( line - 2, report_line_len + 2 );
+    }
+    else if ( REPORT_BINARY == report_format )
+    {
+        header.magic = ZPV_REPORT_MAGIC;
+        header.type = ZPV_REPORT_EVENT;
+        header.length = sizeof( header ) + report_line_len - 1 <= UINT16_MAX ? sizeof( header ) + report_line_len - 1 : 0;
+        memcpy( line - sizeof( header ), &header, sizeof( header ) );
+        if ( header.length )
+            report_add( line - sizeof( header ), header.length );
+        else
+            ++reports_dropped;
+    }
+    else
+        report_add( line, report_line_len );
+
+    report_line_len = 0;
+    report_write();
+}
+
+// The write function of report, called with whatever fprintf produced
+static ssize_t report_cookie_write(void *cookie, const char *data, size_t size)
+{
+    const char *end = data + size, *newline;
+    size_t len, room;
+
+    while ( data < end )
+    {
+        newline = memchr( data, '\n', end - data );
+        len = ( newline ? newline + 1 : end ) - data;
+        room = REPORT_LINE_MAX - report_line_len;
+        memcpy( report_line + REPORT_PREFIX + report_line_len, data, len < room ? len : room );
+        report_line_len += len < room ? len : room;
+        data += len;
+        if ( newline )
+            report_commit();
+    }
+    return size;
+}
+
+// Write out what is still queued before zpv exits, blocking if need be
+static void report_flush()
+{
+    struct pollfd pfd = { STDERR_FILENO, POLLOUT, 0 };
+    while ( report_len )
+    {
+        report_write();
+        if ( report_len && 0 > poll( &pfd, 1, -1 ) && EINTR != errno )
+            break;
+    }
+    if ( -1 != report_flags )
+        fcntl( STDERR_FILENO, F_SETFL, report_flags );
+}
+
+static void report_setup()
+{
+    cookie_io_functions_t io = { NULL, report_cookie_write, NULL, NULL };
+
+    report_interval = DEFAULT_REPORT_INTERVAL;
+    if ( !( report = fopencookie( NULL, "w", io ) ) )
+    {
+        report = stderr;
+        return;
+    }
+    setvbuf( report, NULL, _IONBF, 0 );
+
+    if ( -1 != ( report_flags = fcntl( STDERR_FILENO, F_GETFL, 0 ) ) )
+        fcntl( STDERR_FILENO, F_SETFL, report_flags | O_NONBLOCK );
+    ev_io_init (&report_watcher, report_callback, STDERR_FILENO, EV_WRITE);
+    atexit( report_flush );
+}
+
+static int report_format_from_name(const char *name)
+{
+    if ( !strcmp( name, "json" ) )   return REPORT_JSON;
+    if ( !strcmp( name, "csv" ) )    return REPORT_CSV;
+    if ( !strcmp( name, "binary" ) ) return REPORT_BINARY;
+    return -1;
+}
+
+static void report_csv_header()
+{
+    static const char header[] = "posix_time,stream,total_time_ms,stdin_wait_ms,stdout_wait_ms,throttled_ms,"
+        "bytes_in,bytes_out,reads,writes,read_size,rate_1s,rate_10s,rate_60s,rate_ewma,size,records,reports_dropped\n";
+    report_add( header, sizeof( header ) - 1 );
+    report_write();
+}
+
+// print s escaped for use inside a JSON string
+static void print_string(const char *s)
+{
+    for ( ; *s ; ++s )
+    {
+        if ( '"' == *s || '\\' == *s )
+            fprintf( report, "\\%c", *s );
+        else if ( 0x20 > (unsigned char)*s )
+            fprintf( report, "\\u%04x", *s );
+        else
+            fputc( *s, report );
+    }
+}
+
+// Open a JSON line up to and including posix_time. In multi-stream mode lines
+// about a stream start with its id.
+static void print_start(stream_t *s, ev_tstamp now)
+{
+    fprintf(report, "{ ");
+    if ( s && s->id )
+    {
+        fprintf(report, "\"stream\": \"");
+        print_string( s->id );
+        fprintf(report, "\", ");
+    }
+
+    fprintf(report, "\"posix_time\": %f, ", now);
+}
+
+static int hist_index(uint64_t us)
+{
+    int shift;
+    if ( HIST_SUB > us )
+        return us;
+    if ( us >> HIST_MAX_BITS )
+        return HIST_BUCKETS - 1;
+    shift = 63 - __builtin_clzll( us ) - ( HIST_SUB_BITS - 1 );
+    return HIST_SUB + ( shift - 1 ) * HIST_SUB / 2 + ( us >> shift ) - HIST_SUB / 2;
+}
+
+// the largest wait in microseconds that falls into bucket i
+static uint64_t hist_value(int i)
+{
+    int shift;
+    if ( HIST_SUB > i )
+        return i;
+    i -= HIST_SUB;
+    shift = i / ( HIST_SUB / 2 ) + 1;
+    return ( (uint64_t)( i % ( HIST_SUB / 2 ) + HIST_SUB / 2 + 1 ) << shift ) - 1;
+}
+
+// Fill us with the HIST_PERCENTILES of the waits in counts, in microseconds,
+// and return how many waits there are
+static const int percentiles[] = { 50, 90, 99, 100 };
+#define HIST_PERCENTILES (int)( sizeof( percentiles ) / sizeof( percentiles[0] ) )
+
+static int64_t hist_percentiles(const int64_t *counts, uint64_t *us)
+{
+    int64_t total = 0, seen = 0;
+    int i, p = 0;
+
+    for ( i = 0 ; i < HIST_BUCKETS ; ++i )
+        total += counts[i];
+
+    for ( i = 0 ; total && i < HIST_BUCKETS ; ++i )
+        for ( seen += counts[i] ; p < HIST_PERCENTILES && seen * 100 >= total * percentiles[p] ; ++p )
+            us[p] = hist_value( i );
+    for ( ; p < HIST_PERCENTILES ; ++p )
+        us[p] = 0;
+
+    return total;
+}
+
+static void print_percentiles(const int64_t *counts)
+{
+    uint64_t us[ HIST_PERCENTILES ];
+    int64_t total = hist_percentiles( counts, us );
+    int p;
+
+    fprintf(report, "{ \"count\": %lld", (long long)total);
+    for ( p = 0 ; p < HIST_PERCENTILES - 1 ; ++p )
+        fprintf(report, ", \"p%d_ms\": %.3f", percentiles[p], us[p] / 1000.0);
+    fprintf(report, ", \"max_ms\": %.3f }", us[p] / 1000.0);
+}
+
+static void waits_snapshot(pipe_t *p)
+{
+    int i;
+    for ( i = 0 ; i < HIST_BUCKETS ; ++i )
+    {
+        int64_t count = STAT( p->waits[i] );
+        p->waits_interval[i] = count - p->waits_total[i];
+        p->waits_total[i] = count;
     }
+}
+
+// Percentiles of the waits since the previous report and since the start
+static void print_waits(pipe_t *p)
+{
+    fprintf(report, "{ \"interval\": ");
+    print_percentiles( p->waits_interval );
+    fprintf(report, ", \"total\": ");
+    print_percentiles( p->waits_total );
+    fprintf(report, " }");
+}
+
+// Bytes per second over about the last seconds, or since the start if that
+// is shorter
+static double rate_window(stream_t *s, int seconds)
+{
+    int back = seconds < s->rate_count - 1 ? seconds : s->rate_count - 1;
+    int then = ( s->rate_head - back + RATE_SAMPLES ) % RATE_SAMPLES;
+    ev_tstamp elapsed = s->rate_times[ s->rate_head ] - s->rate_times[ then ];
+    return 0 < elapsed ? ( s->rate_bytes[ s->rate_head ] - s->rate_bytes[ then ] ) / elapsed : 0;
+}
+
+static void rate_sample(stream_t *s, ev_tstamp now)
+{
+    int64_t bytes = STAT( s->outputs[0].bytes_out );
+    int prev = s->rate_head;
+    ev_tstamp elapsed;
+
+    // the first rate seeds the average, later ones are weighted by how much
+    // time they cover
+    if ( s->rate_count && 0 < ( elapsed = now - s->rate_times[ prev ] ) )
+        s->rate_ewma += ( 1 == s->rate_count ? 1 : elapsed / ( RATE_EWMA_TAU + elapsed ) )
+            * ( ( bytes - s->rate_bytes[ prev ] ) / elapsed - s->rate_ewma );
 
-    if( 0 < data_size )
+    s->rate_head = s->rate_count ? ( prev + 1 ) % RATE_SAMPLES : 0;
+    s->rate_bytes[ s->rate_head ] = bytes;
+    s->rate_times[ s->rate_head ] = now;
+    if ( s->rate_count < RATE_SAMPLES )
+        ++s->rate_count;
+
+    s->rate_1s = rate_window( s, 1 );
+    s->rate_10s = rate_window( s, 10 );
+    s->rate_60s = rate_window( s, 60 );
+}
+
+static void count_size(pipe_t *p, int64_t size)
+{
+    int i = 1 >= size ? 0 : 64 - __builtin_clzll( size - 1 );
+    STAT_ADD( p->sizes[ SIZE_BUCKETS > i ? i : SIZE_BUCKETS - 1 ], 1 );
+}
+
+// the non-empty buckets, each keyed by the largest size it holds
+static void print_sizes(pipe_t *p)
+{
+    const char *sep = "";
+    int i;
+
+    fprintf(report, "{ ");
+    for ( i = 0 ; i < SIZE_BUCKETS ; ++i )
     {
-        // switch to write mode
-        ev_tstamp now = ev_now( loop );
+        int64_t count = STAT( p->sizes[i] );
+        if ( count )
+        {
+            fprintf(report, "%s\"%lld\": %lld", sep, 1LL << i, (long long)count);
+            sep = ", ";
+        }
+    }
+    fprintf(report, " }");
+}
 
-        mode = WRITING;
-        stdout_pipe.timer_start = now;
+// The periodic report of -F csv and -F binary, the main counters only
+static void report_stats(stream_t *s, ev_tstamp now)
+{
+    zpv_report_stats_t r;
+    char line[1024];
+    const char *id;
+    int len = 0;
+
+    memset( &r, 0, sizeof( r ) );
+    r.header.magic = ZPV_REPORT_MAGIC;
+    r.header.type = ZPV_REPORT_STATS;
+    r.header.length = sizeof( r );
+    if ( s->id )
+        strncpy( r.stream, s->id, sizeof( r.stream ) - 1 );
+    r.posix_time = now;
+    r.total_time = now - start_time;
+    r.stdin_wait = time_waiting( &s->input, now );
+    r.stdout_wait = time_waiting( &s->outputs[0].pipe, now );
+    r.throttled = time_throttled( s, now );
+    r.bytes_in = STAT( s->bytes_in );
+    r.bytes_out = STAT( s->outputs[0].bytes_out );
+    r.reads = STAT( s->input.syscalls );
+    r.writes = STAT( s->outputs[0].pipe.syscalls );
+    r.size = s->size;
+    r.records = 0 <= record_delim ? STAT( s->records ) : -1;
+    r.reports_dropped = reports_dropped;
+    r.rate_1s = s->rate_1s;
+    r.rate_10s = s->rate_10s;
+    r.rate_60s = s->rate_60s;
+    r.rate_ewma = s->rate_ewma;
+    r.read_size = STAT( s->read_size );
 
-        if( 0 < stdin_pipe.timer_start )
-            stdin_pipe.time_waiting += now - stdin_pipe.timer_start;
+    if ( REPORT_BINARY == report_format )
+    {
+        report_add( &r, sizeof( r ) );
+        report_write();
+        return;
+    }
 
-        ev_io_init (&stdout_pipe.watcher, stdout_callback, STDOUT_FILENO, EV_WRITE);
-        ev_io_start( loop, &stdout_pipe.watcher ); // start stdout
-        ev_io_stop( loop, &stdin_pipe.watcher ); // stop stdin
+    // the id quoted as CSV wants it, if at all
+    len = snprintf( line, sizeof( line ), "%f,", now );
+    if ( s->id )
+    {
+        line[ len++ ] = '"';
+        for ( id = r.stream ; *id ; ++id )
+        {
+            if ( '"' == *id )
+                line[ len++ ] = '"';
+            line[ len++ ] = *id;
+        }
+        line[ len++ ] = '"';
     }
+    len += snprintf( line + len, sizeof( line ) - len,
+        ",%d,%d,%d,%d,%lld,%lld,%lld,%lld,%d,%.0f,%.0f,%.0f,%.0f,%lld,%lld,%lld\n",
+        (int)( 1000 * r.total_time ), (int)( 1000 * r.stdin_wait ), (int)( 1000 * r.stdout_wait ), (int)( 1000 * r.throttled ),
+        (long long)r.bytes_in, (long long)r.bytes_out, (long long)r.reads, (long long)r.writes, r.read_size,
+        r.rate_1s, r.rate_10s, r.rate_60s, r.rate_ewma, (long long)r.size, (long long)r.records, (long long)r.reports_dropped );
+    report_add( line, len );
+    report_write();
 }
 
-static void stdout_callback (EV_P_ ev_io *w, int revents)
+static void print_timer(stream_t *s)
 {
-    if ( 0 < data_size )
+    int i;
+    struct rusage usage;
+    ev_tstamp now = ev_time();
+    ev_tstamp total_time = now - start_time;
+    pipe_t *stdout_pipe = &s->outputs[0].pipe;
+    int64_t bytes_out = STAT( s->outputs[0].bytes_out );
+    int64_t reads = STAT( s->input.syscalls ), writes = STAT( stdout_pipe->syscalls );
+    if ( 0 >= total_time ) return;
+    waits_snapshot( &s->input );
+    for ( i = 0 ; i < s->output_count ; ++i )
+        waits_snapshot( &s->outputs[i].pipe );
+
+    if ( REPORT_JSON != report_format )
+    {
+        report_stats( s, now );
+        return;
+    }
+
+    print_start( s, now );
+    fprintf(report, "\"stdin_wait_ms\": %d, \"stdout_wait_ms\": %d, \"total_time_ms\": %d, \"bytes_out\": %lld, "
+        "\"read_size\": %d, \"stdin_pipe_size\": %d, \"stdout_pipe_size\": %d, \"bytes_per_read\": %lld, \"bytes_per_write\": %lld",
+        (int)(1000 * time_waiting( &s->input, now ) ),
+        (int)(1000 * time_waiting( stdout_pipe, now ) ),
+        (int)(1000 * total_time), (long long)bytes_out,
+        STAT( s->read_size ), STAT( s->input.pipe_size ), STAT( stdout_pipe->pipe_size ),
+        (long long)( reads ? STAT( s->bytes_in ) / reads : 0 ),
+        (long long)( writes ? bytes_out / writes : 0 ) );
+
+    if ( rate_limit )
+        fprintf(report, ", \"throttled_ms\": %d", (int)(1000 * time_throttled( s, now ) ));
+
+    if ( 0 <= record_delim )
+    {
+        int64_t records = STAT( s->records );
+        fprintf(report, ", \"records\": %lld, \"records_interval\": %lld, \"records_per_s\": %.0f",
+            (long long)records, (long long)( records - s->records_reported ),
+            now > s->records_time ? ( records - s->records_reported ) / ( now - s->records_time ) : 0.0);
+        s->records_reported = records;
+        s->records_time = now;
+    }
+
+    fprintf(report, ", \"rate_1s\": %.0f, \"rate_10s\": %.0f, \"rate_60s\": %.0f, \"rate_ewma\": %.0f",
+        s->rate_1s, s->rate_10s, s->rate_60s, s->rate_ewma);
+    if ( 0 <= s->size )
+    {
+        fprintf(report, ", \"size\": %lld, \"percent\": %.1f", (long long)s->size,
+            0 < s->size ? 100.0 * bytes_out / s->size : 100.0);
+        if ( 1 <= s->rate_ewma && bytes_out < s->size )
+            fprintf(report, ", \"eta_s\": %.0f", ( s->size - bytes_out ) / s->rate_ewma);
+    }
+
+    // the loop and the CPU time are the whole process's, for every stream
+    getrusage( RUSAGE_SELF, &usage );
+    fprintf(report, ", \"reads\": %lld, \"writes\": %lld, \"read_bytes\": ", (long long)reads, (long long)writes);
+    print_sizes( &s->input );
+    fprintf(report, ", \"write_bytes\": ");
+    print_sizes( stdout_pipe );
+    fprintf(report, ", \"loop_iterations\": %u, \"user_cpu_ms\": %lld, \"system_cpu_ms\": %lld",
+        ev_iteration( loop ),
+        usage.ru_utime.tv_sec * 1000LL + usage.ru_utime.tv_usec / 1000,
+        usage.ru_stime.tv_sec * 1000LL + usage.ru_stime.tv_usec / 1000);
+
+    fprintf(report, ", \"stdin_waits\": ");
+    print_waits( &s->input );
+    fprintf(report, ", \"stdout_waits\": ");
+    print_waits( stdout_pipe );
+
+    if ( 1 < s->output_count )
     {
-        if ( data_size != write( STDOUT_FILENO, &data[ 0 ], data_size ) )
+        fprintf(report, ", \"outputs\": [ ");
+        for ( i = 0 ; i < s->output_count ; ++i )
         {
-            print_timer();
-            fprintf(stderr, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Error writing to stdout\" }\n", ev_time());
-            exit(data_size);
+            fprintf(report, "%s{ \"name\": \"", i ? ", " : "");
+            print_string( s->outputs[i].name );
+            fprintf(report, "\", \"wait_ms\": %d, \"bytes_out\": %lld, \"writes\": %lld, \"write_bytes\": ",
+                (int)(1000 * time_waiting( &s->outputs[i].pipe, now ) ), (long long)STAT( s->outputs[i].bytes_out ),
+                (long long)STAT( s->outputs[i].pipe.syscalls ));
+            print_sizes( &s->outputs[i].pipe );
+            fprintf(report, ", \"waits\": ");
+            print_waits( &s->outputs[i].pipe );
+            fprintf(report, " }");
         }
+        fprintf(report, " ]");
+    }
+
+    if ( reports_dropped )
+        fprintf(report, ", \"reports_dropped\": %lld", (long long)reports_dropped);
+    fprintf(report, " }\n");
+}
+
+static void wait_start(pipe_t *p, ev_tstamp now)
+{
+    if ( 0 > p->timer_start )
+        __atomic_store( &p->timer_start, &now, __ATOMIC_RELEASE );
+}
 
-        bytes_out += data_size;
-        data_size = 0;
+static void wait_stop(pipe_t *p, ev_tstamp now)
+{
+    ev_tstamp waited;
+    if ( 0 <= p->timer_start )
+    {
+        STAT_ADD( p->waits[ hist_index( 1e6 * ( now - p->timer_start ) ) ], 1 );
+        waited = p->time_waiting + now - p->timer_start;
+        __atomic_store( &p->time_waiting, &waited, __ATOMIC_RELAXED );
+        now = -1;
+        __atomic_store( &p->timer_start, &now, __ATOMIC_RELEASE );
     }
+}
+
+static double rate_burst()
+{
+    return rate_limit * RATE_BURST > 1 ? rate_limit * RATE_BURST : 1;
+}
 
-    if ( 0 == data_size )
+// The smallest read worth resuming the input for
+static double rate_chunk(stream_t *s)
+{
+    return s->read_size < rate_burst() ? s->read_size : rate_burst();
+}
+
+// Seconds until the token bucket holds a chunk, 0 if it does now
+static ev_tstamp rate_delay(stream_t *s, ev_tstamp now)
+{
+    s->tokens += rate_limit * ( now - s->refilled );
+    if ( s->tokens > rate_burst() )
+        s->tokens = rate_burst();
+    s->refilled = now;
+
+    return s->tokens >= rate_chunk( s ) ? 0 : ( rate_chunk( s ) - s->tokens ) / rate_limit;
+}
+
+// Bytes the next read may ask for
+static int read_len(stream_t *s)
+{
+    return rate_limit && s->tokens < s->read_size ? (int)s->tokens : s->read_size;
+}
+
+static void throttle_start(stream_t *s, ev_tstamp now)
+{
+    if ( 0 > s->throttle_start )
+        __atomic_store( &s->throttle_start, &now, __ATOMIC_RELEASE );
+}
+
+static void throttle_stop(stream_t *s, ev_tstamp now)
+{
+    ev_tstamp throttled;
+    if ( 0 <= s->throttle_start )
     {
-        // Switch to read mode
+        throttled = s->time_throttled + now - s->throttle_start;
+        __atomic_store( &s->time_throttled, &throttled, __ATOMIC_RELAXED );
+        now = -1;
+        __atomic_store( &s->throttle_start, &now, __ATOMIC_RELEASE );
+    }
+}
 
-        ev_tstamp now = ev_now( loop );
-        mode = READING;
+// Whether the input may read now. If not, the refill timer is set for when
+// it may, and the time until then counts as throttled rather than waiting.
+static int rate_allows(stream_t *s, ev_tstamp now)
+{
+    ev_tstamp delay;
 
-        stdin_pipe.timer_start = now;
+    if ( !rate_limit )
+        return 1;
 
-        if ( 0 < stdout_pipe.timer_start )
-            stdout_pipe.time_waiting += now - stdout_pipe.timer_start;
+    if ( 0 == ( delay = rate_delay( s, now ) ) )
+    {
+        throttle_stop( s, now );
+        return 1;
+    }
 
-        ev_io_init (&stdin_pipe.watcher, stdin_callback, STDIN_FILENO, EV_READ);
-        ev_io_start( loop, &stdin_pipe.watcher );
-        ev_io_stop( loop, &stdout_pipe.watcher );
+    throttle_start( s, now );
+    if ( !ev_is_active( &s->refill ) )
+    {
+        ev_timer_set( &s->refill, delay, 0 );
+        ev_timer_start( loop, &s->refill );
     }
+    return 0;
 }
 
-static void timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+// Copy the counters of s into its record in the stats segment. status is 1
+// while the stream runs, 0 once it ended and -1 if it failed.
+static void stats_publish(stream_t *s, int status)
+{
+    zpv_stats_stream_t *st = s->stats;
+    uint32_t seq;
+
+    if ( !st )
+        return;
+
+    seq = st->seq;
+    __atomic_store_n( &st->seq, seq + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    st->status = status;
+    st->bytes_in = STAT( s->bytes_in );
+    st->bytes_out = STAT( s->outputs[0].bytes_out );
+    st->reads = STAT( s->input.syscalls );
+    st->writes = STAT( s->outputs[0].pipe.syscalls );
+    st->read_size = STAT( s->read_size );
+    __atomic_load( &s->input.time_waiting, &st->stdin_wait, __ATOMIC_RELAXED );
+    __atomic_load( &s->input.timer_start, &st->stdin_wait_start, __ATOMIC_ACQUIRE );
+    __atomic_load( &s->outputs[0].pipe.time_waiting, &st->stdout_wait, __ATOMIC_RELAXED );
+    __atomic_load( &s->outputs[0].pipe.timer_start, &st->stdout_wait_start, __ATOMIC_ACQUIRE );
+    __atomic_load( &s->time_throttled, &st->throttled, __ATOMIC_RELAXED );
+    __atomic_load( &s->throttle_start, &st->throttle_start, __ATOMIC_ACQUIRE );
+    st->updated = ev_now( loop );
+    st->size = s->size;
+    st->rate_1s = s->rate_1s;
+    st->rate_10s = s->rate_10s;
+    st->rate_60s = s->rate_60s;
+    st->rate_ewma = s->rate_ewma;
+
+    __atomic_store_n( &st->seq, seq + 2, __ATOMIC_RELEASE );
+}
+
+#if EV_USE_IOURING
+// In io_uring mode zpv does not wait for readiness at all. It submits the
+// reads and writes themselves on a ring of its own, shared by all streams,
+// with the slot buffers and the file descriptors registered up front. A read
+// of the slot the first output is waiting for is linked to the write of that
+// slot, so when a chunk comes in whole it is read and written by one
+// submission. A short read breaks the link, and the write is submitted once
+// the size is known. Every fd has at most one request in flight, which keeps
+// the stream in order.
+// A request is counted as waiting for as long as it is in flight.
+#define URING_READ 0xffffffffU // low half of the user_data of reads, writes carry the output index
+#define URING_POLL 0xfffffffeU
+#define URING_LOAD(v) __atomic_load_n( &(v), __ATOMIC_ACQUIRE )
+#define URING_STORE(v,n) __atomic_store_n( &(v), (n), __ATOMIC_RELEASE )
+
+struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    int blocked; // streams with sq_blocked set
+} uring;
+ev_io uring_watcher;
+ev_prepare uring_prepare;
+
+static void uring_submit()
 {
-    static int bytes = 0;
-    if ( bytes > 0 && bytes >= bytes_out )
+    int res;
+
+    while ( 0 < uring.to_submit )
     {
-        if( mode == READING )
-            fprintf(stderr, "{ \"posix_time\": %f, \"msg\": \"Stalled reading from stdin\" }\n", ev_time());
+        if ( 0 < ( res = evsys_io_uring_enter( uring.fd, uring.to_submit, 0, 0, NULL, 0 ) ) )
+            uring.to_submit -= res;
+        else if ( 0 > res && EINTR != errno && EAGAIN != errno && EBUSY != errno )
+        {
+            fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Error submitting to io_uring\", \"errno\": %d }\n", ev_time(), errno);
+            exit(1);
+        }
         else
-            fprintf(stderr, "{ \"posix_time\": %f, \"msg\": \"Stalled writing to stdout\" }\n", ev_time());
+            return; // try again before the loop sleeps next time
     }
+}
 
-    bytes = bytes_out;
-    print_timer();
+// Whether n more requests fit in the submission queue, submitting what is
+// queued to make room. The kernel may refuse (EAGAIN, EBUSY), and then the
+// entries it has not taken must not be reused.
+static int uring_room(unsigned n)
+{
+    if ( uring.sq_entries - ( *uring.sq_tail - URING_LOAD( *uring.sq_head ) ) < n )
+        uring_submit();
+    return uring.sq_entries - ( *uring.sq_tail - URING_LOAD( *uring.sq_head ) ) >= n;
 }
 
-static void sigint_callback (struct ev_loop *loop, ev_signal *w, int revents)
+// Queue a request on file, 0 being the input of s and its outputs following.
+// uring_room must have made room for it.
+static struct io_uring_sqe *uring_sqe(stream_t *s, int opcode, int file, __u32 what, int flags)
 {
-    print_timer();
-    fprintf(stderr, "{ \"posix_time\": %f, \"exit_status\": \"Success\", \"msg\": \"Received SIGINT\" }\n", ev_time() );
-    exit(0);
+    unsigned tail, index;
+    struct io_uring_sqe *sqe;
+
+    tail = *uring.sq_tail;
+    index = tail & *uring.sq_mask;
+    sqe = &uring.sqes[ index ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE | flags;
+    sqe->fd = s->file_base + file;
+    sqe->user_data = (__u64)( s - streams ) << 32 | what;
+    uring.sq_array[ index ] = index;
+    URING_STORE( *uring.sq_tail, tail + 1 );
+    ++uring.to_submit;
+    return sqe;
 }
 
-int main(int argc, char **argv)
+// Queue a read or write of the bytes of slot from offset on
+static void uring_rw(stream_t *s, int opcode, int file, int slot, int offset, int len, __u32 what, int flags)
 {
-    int flags;
-    mode = READING;
-    data_size = 0;
-    bytes_out = 0;
-    loop = ev_loop_new( EVBACKEND_SELECT );
-    start_time = ev_time();
-    stdout_pipe.time_waiting = 0;
-    stdout_pipe.timer_start = -1;
-    stdin_pipe.time_waiting = 0;
-    stdin_pipe.timer_start = -1;
+    struct io_uring_sqe *sqe = uring_sqe( s, opcode, file, what, flags );
+    sqe->off = (__u64)-1; // current file position
+    sqe->addr = (unsigned long)( s->ring[ slot ].data + offset );
+    sqe->len = len;
+    sqe->buf_index = s->buf_base + slot;
+}
 
-/*
-    flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    if ( fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK | flags ) == -1 )
-        fprintf(stderr, "{ \"msg\": \"Could not set O_NONBLOCK on stdin\" }\n", data_size, errno);
+// Out of room, so try s again from uring_submit_callback
+static void uring_block(stream_t *s)
+{
+    if ( !s->sq_blocked )
+    {
+        s->sq_blocked = 1;
+        ++uring.blocked;
+    }
+}
 
-    flags = fcntl(STDOUT_FILENO, F_GETFL, 0);
-    if ( fcntl(STDOUT_FILENO, F_SETFL, O_NONBLOCK | flags ) == -1 )
-        fprintf(stderr, "{ \"msg\": \"Could not set O_NONBLOCK on stdout\" }\n", data_size, errno);
-*/
+static void uring_update(stream_t *s, ev_tstamp now)
+{
+    int i, link, len;
+    output_t *first = &s->outputs[0];
 
-    ev_io_init (&stdout_pipe.watcher, stdout_callback, STDOUT_FILENO, EV_WRITE);
-    ev_io_init (&stdin_pipe.watcher, stdin_callback, STDIN_FILENO, EV_READ);
-    ev_io_start( loop, &stdin_pipe.watcher );
+    if ( 0 < s->input_status && s->ring_count < s->ring_slots && !s->reading && rate_allows( s, now ) )
+    {
+        // the first output has caught up, so the next chunk can go straight out
+        link = 0 == first->count && !first->writing;
 
-    ev_timer_init (&timer, timer_callback, 2.0, 2.0);
-    ev_timer_start (loop, &timer);
+        // a linked chain is queued whole or not at all
+        if ( !uring_room( !!s->wait_writer + 1 + link ) )
+        {
+            uring_block( s );
+            return;
+        }
 
-    ev_signal_init (&exitsig, sigint_callback, SIGINT);
-    ev_signal_start (loop, &exitsig);
+        // a FIFO reads as end of file until a writer opens it, so wait for data
+        if ( s->wait_writer )
+            uring_sqe( s, IORING_OP_POLL_ADD, 0, URING_POLL, IOSQE_IO_LINK )->poll32_events = POLLIN;
+
+        len = read_len( s );
+        uring_rw( s, IORING_OP_READ_FIXED, 0, s->ring_head, 0, len, URING_READ, link ? IOSQE_IO_LINK : 0 );
+        s->reading = 1;
+        ++s->input.syscalls;
+        wait_start( &s->input, now );
+
+        if ( link )
+        {
+            uring_rw( s, IORING_OP_WRITE_FIXED, 1, s->ring_head, 0, len, 0, 0 );
+            first->writing = 1;
+            ++first->pipe.syscalls;
+        }
+    }
+
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        output_t *out = &s->outputs[i];
+        if ( 0 == out->count || out->writing )
+            continue;
+
+        if ( !uring_room( 1 ) )
+        {
+            uring_block( s );
+            return;
+        }
+
+        uring_rw( s, IORING_OP_WRITE_FIXED, i + 1, out->tail, out->offset, s->ring[ out->tail ].size - out->offset, i, 0 );
+        out->writing = 1;
+        ++out->pipe.syscalls;
+        wait_start( &out->pipe, now );
+    }
+}
+#else
+static void uring_update(stream_t *s, ev_tstamp now)
+{
+}
+#endif
+
+// A single stream takes zpv down with it. In multi-stream mode the stream's
+// files are closed and zpv keeps going until the last stream has ended.
+static void stream_end(stream_t *s, int status)
+{
+    int i;
+
+    stats_publish( s, status ? -1 : 0 );
+    if ( !s->id )
+        exit(status);
+
+    if ( status )
+        exit_status = 1;
+
+    s->done = 1;
+    ev_timer_stop( loop, &s->refill );
+    ev_io_stop( loop, &s->input.watcher );
+    close( s->input.watcher.fd );
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        output_t *out = &s->outputs[i];
+        ev_io_stop( loop, &out->pipe.watcher );
+        close( out->pipe.watcher.fd );
+        if ( s->use_splice && out->stage[0] != s->splice_pipe[0] )
+        {
+            close( out->stage[0] );
+            close( out->stage[1] );
+        }
+    }
+
+    if ( s->use_splice )
+    {
+        close( s->splice_pipe[0] );
+        close( s->splice_pipe[1] );
+    }
+
+    if ( 0 == --streams_active )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"%s\", \"msg\": \"All streams ended\" }\n", ev_time(), exit_status ? "Error" : "Success");
+        exit(exit_status);
+    }
+}
+
+// The digests of everything read, which the outputs have all been sent
+static void print_digests(stream_t *s)
+{
+    uint8_t digest[32];
+    int i;
+
+    if ( hashes & HASH_CRC32C )
+        fprintf(report, ", \"crc32c\": \"%08x\"", s->crc32c);
+    if ( hashes & HASH_SHA256 )
+    {
+        sha256_final( &s->sha256, digest );
+        fprintf(report, ", \"sha256\": \"");
+        for ( i = 0 ; i < 32 ; ++i )
+            fprintf(report, "%02x", digest[i]);
+        fprintf(report, "\"");
+    }
+}
+
+// The input has ended and the ring is drained
+static void stream_finish(stream_t *s)
+{
+    print_timer( s );
+    print_start( s, ev_time() );
+    if ( 0 == s->input_status )
+        fprintf(report, "\"exit_status\": \"Success\", \"msg\": \"End of file reached\"");
+    else
+    {
+        fprintf(report, "\"exit_status\": \"Error\",  \"msg\": \"Error reading from ");
+        print_string( s->name );
+        fprintf(report, "\", \"errno\": %d", -s->input_status);
+    }
+    print_digests( s );
+    fprintf(report, " }\n");
+
+    stream_end( s, s->input_status );
+}
+
+// A write to out failed with errno
+static void output_failed(output_t *out)
+{
+    print_timer( out->stream );
+    print_start( out->stream, ev_time() );
+    fprintf(report, "\"exit_status\": \"Error\",  \"msg\": \"Error writing to ");
+    print_string( out->name );
+    fprintf(report, "\", \"errno\": %d }\n", errno);
+    stream_end( out->stream, 1 );
+}
+
+// Start or stop the watchers and wait timers to match the ring fill level
+static void ring_update(stream_t *s)
+{
+    int i;
+    ev_tstamp now = ev_now( loop );
+
+    if ( 0 == s->ring_count && 0 >= s->input_status )
+    {
+        stream_finish( s );
+        return;
+    }
+
+    if ( use_uring )
+    {
+        uring_update( s, now );
+        stats_publish( s, 1 );
+        return;
+    }
+
+    if ( s->use_file )
+    {
+        for ( i = 0 ; i < s->output_count ; ++i )
+            if ( !s->outputs[i].finished )
+                ev_io_start( loop, &s->outputs[i].pipe.watcher );
+        stats_publish( s, 1 );
+        return;
+    }
+
+    if ( 0 >= s->input_status || s->ring_count == s->ring_slots || !rate_allows( s, now ) )
+        ev_io_stop( loop, &s->input.watcher );
+    else
+        ev_io_start( loop, &s->input.watcher );
+
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        output_t *out = &s->outputs[i];
+
+        if ( s->ring_count == s->ring_slots && out->count == s->ring_count )
+            wait_start( &out->pipe, now );
+        else
+            wait_stop( &out->pipe, now );
+
+        if ( 0 < out->count )
+            ev_io_start( loop, &out->pipe.watcher );
+        else
+            ev_io_stop( loop, &out->pipe.watcher );
+    }
+
+    if ( 0 < s->ring_count || 0 <= s->throttle_start )
+        wait_stop( &s->input, now );
+    else
+        wait_start( &s->input, now );
+
+    stats_publish( s, 1 );
+}
+
+static void pipe_grow(pipe_t *p, int size)
+{
+    if ( size > pipe_max )
+        size = pipe_max;
+
+    if ( 0 >= p->pipe_size || size <= p->pipe_size )
+        return;
+
+    if ( 0 < ( size = fcntl( p->watcher.fd, F_SETPIPE_SZ, size ) ) )
+        p->pipe_size = size;
+    else
+        pipe_max = p->pipe_size; // over the system limit, stop trying
+}
+
+// Called after every read. Once several reads in a row came back full, ask
+// the kernel how much more is waiting on the input. A bigger backlog than we
+// can read at once means zpv is the bottleneck: grow the read size, make room
+// for the bigger chunks on the outputs, and if the input pipe is full, grow it too.
+static void tune_read_size(stream_t *s, int size)
+{
+    int avail, i;
+
+    if ( size < s->read_size )
+    {
+        s->full_reads = 0;
+        return;
+    }
+
+    if ( ++s->full_reads < TUNE_FULL_READS )
+        return;
+
+    s->full_reads = 0;
+    if ( s->read_size >= s->slot_size && ( 0 >= s->input.pipe_size || s->input.pipe_size >= pipe_max ) )
+        return; // nothing left to tune
+
+    if ( 0 != ioctl( s->input.watcher.fd, FIONREAD, &avail ) || 0 >= avail )
+        return;
+
+    if ( s->read_size < s->slot_size )
+    {
+        do
+            s->read_size *= 2;
+        while ( s->read_size < avail && s->read_size < s->slot_size );
+
+        if ( s->read_size > s->slot_size )
+            s->read_size = s->slot_size;
+
+        for ( i = 0 ; i < s->output_count ; ++i )
+            pipe_grow( &s->outputs[i].pipe, 2 * s->read_size );
+    }
+
+    if ( avail >= s->input.pipe_size )
+        pipe_grow( &s->input, 2 * s->input.pipe_size );
+}
+
+static void splice_error(stream_t *s, const char *msg)
+{
+    print_timer( s );
+    print_start( s, ev_time() );
+    fprintf(report, "\"exit_status\": \"Error\",  \"msg\": \"%s\", \"errno\": %d }\n", msg, errno);
+    exit(1);
+}
+
+static void splice_disable(stream_t *s)
+{
+    int i, j, slot;
+    s->use_splice = 0;
+
+    // move anything still held in the kernel pipes into the slot buffers.
+    // every output holds a copy of the same bytes, so reading them more than
+    // once into the same slot is harmless.
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        output_t *out = &s->outputs[i];
+        for ( j = 0, slot = out->tail ; j < out->count ; ++j, slot = ( slot + 1 ) % s->ring_slots )
+        {
+            int offset = j ? 0 : out->offset;
+            int size = s->ring[ slot ].size - offset;
+            if ( size != read( out->stage[0], s->ring[ slot ].data + offset, size ) )
+                splice_error( s, "Error draining splice pipe" );
+        }
+
+        if ( out->stage[0] != s->splice_pipe[0] )
+        {
+            close( out->stage[0] );
+            close( out->stage[1] );
+        }
+    }
+
+    close( s->splice_pipe[0] );
+    close( s->splice_pipe[1] );
+    print_start( s, ev_time() );
+    fprintf(report, "\"msg\": \"splice not supported, falling back to copy\" }\n");
+}
+
+// EAGAIN from splice can mean either the input or the kernel pipe is not ready
+static int splice_pipe_full(stream_t *s)
+{
+    struct pollfd pfd;
+    pfd.fd = s->splice_pipe[1];
+    pfd.events = POLLOUT;
+    return 0 == poll( &pfd, 1, 0 );
+}
+
+static void stage_write(output_t *out, slot_t *slot, int offset)
+{
+    if ( slot->size - offset != write( out->stage[1], slot->data + offset, slot->size - offset ) )
+        splice_error( out->stream, "Error writing to staging pipe" );
+}
+
+// Fan the chunk just spliced into splice_pipe out to the staging pipes:
+// tee(2) it to every output but the first, then splice(2) it to the first. A
+// staging pipe can run out of page buffers before the ring runs out of
+// slots, in which case the chunk is copied through slot->data instead.
+static void stage_chunk(stream_t *s, slot_t *slot)
+{
+    int i, sent, copied = 0;
+
+    for ( i = 1 ; i < s->output_count ; ++i )
+    {
+        sent = copied ? 0 : tee( s->splice_pipe[0], s->outputs[i].stage[1], slot->size, SPLICE_F_NONBLOCK );
+        if ( sent == slot->size )
+            continue;
+
+        if ( !copied && slot->size != read( s->splice_pipe[0], slot->data, slot->size ) )
+            splice_error( s, "Error draining splice pipe" );
+
+        copied = 1;
+        stage_write( &s->outputs[i], slot, 0 < sent ? sent : 0 );
+    }
+
+    if ( copied )
+    {
+        stage_write( &s->outputs[0], slot, 0 );
+        return;
+    }
+
+    sent = splice( s->splice_pipe[0], NULL, s->outputs[0].stage[1], NULL, slot->size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    if ( sent < slot->size )
+    {
+        sent = 0 < sent ? sent : 0;
+        if ( slot->size - sent != read( s->splice_pipe[0], slot->data + sent, slot->size - sent ) )
+            splice_error( s, "Error draining splice pipe" );
+
+        stage_write( &s->outputs[0], slot, sent );
+    }
+}
+
+// The digests and the record count see every chunk read into the ring
+static void inspect_chunk(stream_t *s, const char *data, int size)
+{
+    if ( 0 <= record_delim )
+        STAT_ADD( s->records, records_count( data, size, record_delim ) );
+    if ( hashes & HASH_CRC32C )
+        s->crc32c = crc32c_update( s->crc32c, data, size );
+    if ( hashes & HASH_SHA256 )
+        sha256_update( &s->sha256, data, size );
+}
+
+// Add the size bytes just read into the slot at ring_head to the ring. A size
+// of 0 is end of file, a negative size is a read error in errno.
+static void ring_push(stream_t *s, int size)
+{
+    slot_t *slot = &s->ring[ s->ring_head ];
+    int i;
+
+    if ( 0 >= size )
+    {
+        s->input_status = 0 == size ? 0 : -errno;
+        return;
+    }
+
+    s->bytes_in += size;
+    count_size( &s->input, size );
+    s->tokens -= size;
+    tune_read_size( s, size );
+    inspect_chunk( s, slot->data, size );
+    slot->size = size;
+    slot->refs = s->output_count;
+    if ( s->use_splice && 1 < s->output_count )
+        stage_chunk( s, slot );
+
+    for ( i = 0 ; i < s->output_count ; ++i )
+        ++s->outputs[i].count;
+
+    s->ring_head = ( s->ring_head + 1 ) % s->ring_slots;
+    ++s->ring_count;
+}
+
+// Account for sent bytes of the tail slot written to out. Returns 0 after a
+// partial write, which leaves the ring as it was, or after a failed write,
+// which ends the stream.
+static int ring_pop(output_t *out, int sent)
+{
+    stream_t *s = out->stream;
+    slot_t *slot = &s->ring[ out->tail ];
+
+    if ( 0 >= sent )
+    {
+        output_failed( out );
+        return 0;
+    }
+
+    out->bytes_out += sent;
+    count_size( &out->pipe, sent );
+    out->offset += sent;
+    if ( out->offset < slot->size )
+        return 0;
+
+    out->offset = 0;
+    out->tail = ( out->tail + 1 ) % s->ring_slots;
+    --out->count;
+
+    // outputs write slots in order, so the last one out is always ring_tail
+    if ( 0 == --slot->refs )
+    {
+        slot->size = 0;
+        s->ring_tail = ( s->ring_tail + 1 ) % s->ring_slots;
+        --s->ring_count;
+    }
+
+    return 1;
+}
+
+static void input_callback (EV_P_ ev_io *w, int revents)
+{
+    stream_t *s = (stream_t *)w->data;
+    slot_t *slot = &s->ring[ s->ring_head ];
+    int size;
+
+    if ( s->use_splice )
+    {
+        ++s->input.syscalls;
+        size = splice( w->fd, NULL, s->splice_pipe[1], NULL, read_len( s ), SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if ( 0 > size && EINVAL == errno )
+            splice_disable( s );
+        else if ( 0 > size && EAGAIN == errno && splice_pipe_full( s ) )
+        {
+            // the kernel pipe is out of buffers before the ring is out of
+            // slots, wait for an output to drain a slot
+            ev_io_stop( loop, &s->input.watcher );
+            return;
+        }
+    }
+
+    if ( !s->use_splice )
+    {
+        ++s->input.syscalls;
+        size = read( w->fd, slot->data, read_len( s ) );
+    }
+
+    if ( 0 > size && ( EAGAIN == errno || EWOULDBLOCK == errno ) )
+    {
+        ev_io_drained( loop, w, EV_READ );
+        return;
+    }
+
+    ring_push( s, size );
+    ring_update( s );
+}
+
+// The input turned out not to work with sendfile(2) before anything was
+// sent, so go back to reading it into the ring
+static void file_disable(stream_t *s)
+{
+    int i;
+    s->use_file = 0;
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        ev_io_stop( loop, &s->outputs[i].pipe.watcher );
+        wait_stop( &s->outputs[i].pipe, ev_now( loop ) );
+    }
+    ring_update( s );
+}
+
+// Send out the next chunk of the file. The output waits from a send that
+// filled it, or would have blocked, until it is writable again.
+static void file_write(output_t *out)
+{
+    stream_t *s = out->stream;
+    size_t len = (size_t)s->slot_size * s->ring_slots;
+    ev_tstamp now = ev_now( loop );
+    off_t end = 0;
+    ssize_t sent;
+    int i;
+
+    // the call reads the input as well, so it counts as a read too
+    ++out->pipe.syscalls;
+    ++s->input.syscalls;
+    if ( out->copy_range )
+    {
+        sent = copy_file_range( s->input.watcher.fd, &out->file_pos, out->pipe.watcher.fd, NULL, len, 0 );
+        // e.g. across file systems on older kernels, sendfile(2) can do it
+        if ( 0 > sent && ( EXDEV == errno || EINVAL == errno || EOPNOTSUPP == errno || ENOSYS == errno ) )
+        {
+            out->copy_range = 0;
+            return;
+        }
+    }
+    else
+        sent = sendfile( out->pipe.watcher.fd, s->input.watcher.fd, &out->file_pos, len );
+
+    if ( 0 > sent && ( EAGAIN == errno || EWOULDBLOCK == errno ) )
+    {
+        ev_io_drained( loop, &out->pipe.watcher, EV_WRITE );
+        wait_start( &out->pipe, now );
+        return;
+    }
+    wait_stop( &out->pipe, now );
+
+    if ( 0 > sent && ( EINVAL == errno || ENOSYS == errno ) && 0 == s->bytes_in )
+    {
+        file_disable( s );
+        return;
+    }
+
+    if ( 0 > sent )
+    {
+        output_failed( out );
+        return;
+    }
+
+    out->bytes_out += sent;
+    if ( 0 < sent )
+    {
+        count_size( &out->pipe, sent );
+        count_size( &s->input, sent );
+        if ( s->bytes_in < out->bytes_out )
+            s->bytes_in = out->bytes_out;
+        if ( (size_t)sent < len )
+            wait_start( &out->pipe, now );
+        return;
+    }
+
+    out->finished = 1;
+    ev_io_stop( loop, &out->pipe.watcher );
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        if ( !s->outputs[i].finished )
+            return;
+        if ( end < s->outputs[i].file_pos )
+            end = s->outputs[i].file_pos;
+    }
+
+    // leave the input where reading it would have, for whoever shares it
+    lseek( s->input.watcher.fd, end, SEEK_SET );
+    s->input_status = 0;
+    stream_finish( s );
+}
+
+static void output_callback (EV_P_ ev_io *w, int revents)
+{
+    output_t *out = (output_t *)w->data;
+    stream_t *s = out->stream;
+    slot_t *slot = &s->ring[ out->tail ];
+    int size = slot->size - out->offset;
+    int sent;
+
+    if ( s->use_file )
+    {
+        file_write( out );
+        return;
+    }
+
+    if ( s->use_splice )
+    {
+        ++out->pipe.syscalls;
+        sent = splice( out->stage[0], NULL, w->fd, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        // the output cannot be spliced, pull the ring back into user space and write it instead
+        if ( 0 > sent && EINVAL == errno )
+            splice_disable( s );
+    }
+
+    if ( !s->use_splice )
+    {
+        ++out->pipe.syscalls;
+        sent = write( w->fd, slot->data + out->offset, size );
+    }
+
+    if ( 0 > sent && ( EAGAIN == errno || EWOULDBLOCK == errno ) )
+    {
+        ev_io_drained( loop, w, EV_WRITE );
+        return;
+    }
+
+    // and a short write leaves it full
+    if ( 0 < sent && sent < size && out->pipe.pipe_size && !s->use_splice )
+        ev_io_drained( loop, w, EV_WRITE );
+
+    // after a partial write, resume when the output is writable again
+    if ( ring_pop( out, sent ) )
+        ring_update( s );
+}
+
+#if EV_USE_IOURING
+static void uring_read_done(stream_t *s, int res, ev_tstamp now)
+{
+    s->reading = 0;
+    wait_stop( &s->input, now );
+    // retried by uring_update, ECANCELED means the poll in front of it failed
+    if ( -EAGAIN == res || -EINTR == res || -ECANCELED == res )
+        return;
+
+    s->wait_writer = 0;
+    if ( 0 > res )
+    {
+        errno = -res;
+        res = -1;
+    }
+
+    ring_push( s, res );
+
+    // a linked write starts now that its data is in
+    if ( s->outputs[0].writing )
+        wait_start( &s->outputs[0].pipe, now );
+}
+
+static void uring_write_done(output_t *out, int res, ev_tstamp now)
+{
+    out->writing = 0;
+    wait_stop( &out->pipe, now );
+
+    // the read linked to this write came back short
+    if ( -ECANCELED == res )
+    {
+        --out->pipe.syscalls;
+        return;
+    }
+
+    if ( -EAGAIN == res || -EINTR == res )
+        return;
+
+    if ( 0 > res )
+    {
+        errno = -res;
+        res = -1;
+    }
+
+    ring_pop( out, res );
+}
+
+static void uring_callback (EV_P_ ev_io *w, int revents)
+{
+    ev_tstamp now = ev_now( loop );
+    unsigned head = *uring.cq_head;
+    unsigned tail = URING_LOAD( *uring.cq_tail );
+
+    for ( ;; )
+    {
+        for ( ; head != tail ; ++head )
+        {
+            struct io_uring_cqe *cqe = &uring.cqes[ head & *uring.cq_mask ];
+            stream_t *s = &streams[ cqe->user_data >> 32 ];
+            __u32 what = (__u32)cqe->user_data;
+            int res = cqe->res;
+
+            URING_STORE( *uring.cq_head, head + 1 );
+            if ( s->done || URING_POLL == what )
+                continue;
+
+            if ( URING_READ == what )
+                uring_read_done( s, res, now );
+            else
+                uring_write_done( &s->outputs[ what ], res, now );
+
+            if ( !s->done )
+                ring_update( s );
+        }
+
+        // With -E the ring counts as ready until it is reported drained. A
+        // completion that arrived before the report is found by the check
+        // after it.
+        ev_io_drained( loop, w, EV_READ );
+        tail = URING_LOAD( *uring.cq_tail );
+        if ( head == tail )
+            break;
+    }
+}
+
+// Submit everything queued during this loop iteration in one go, right
+// before the loop goes to sleep
+static void uring_submit_callback (EV_P_ ev_prepare *w, int revents)
+{
+    int i;
+
+    uring_submit();
+    if ( !uring.blocked )
+        return;
+
+    uring.blocked = 0;
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        if ( !s->sq_blocked )
+            continue;
+
+        s->sq_blocked = 0;
+        if ( !s->done )
+            ring_update( s );
+    }
+    uring_submit();
+}
+
+// Set up the ring and register the slot buffers and file descriptors of all
+// streams with it. Returns 0 if any of it is not supported, in which case zpv
+// copies instead.
+static int uring_setup()
+{
+    struct io_uring_params params;
+    struct iovec *iov;
+    int *files;
+    char *sq, *cq;
+    size_t sq_size, cq_size;
+    int i, j, buffers = 0, file_count = 0;
+
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        streams[i].buf_base = buffers;
+        streams[i].file_base = file_count;
+        buffers += streams[i].ring_slots;
+        file_count += 1 + streams[i].output_count;
+    }
+
+    // a stream has at most a poll, a read and a write per output in flight
+    memset( &params, 0, sizeof( params ) );
+    params.flags = IORING_SETUP_CLAMP;
+    if ( 0 > ( uring.fd = evsys_io_uring_setup( file_count + stream_count, &params ) ) )
+        goto fail;
+
+    if ( !( params.features & IORING_FEAT_RW_CUR_POS ) )
+        goto fail;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    sq = mmap( 0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING );
+    cq = params.features & IORING_FEAT_SINGLE_MMAP ? sq
+        : mmap( 0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING );
+    uring.sqes = mmap( 0, params.sq_entries * sizeof( struct io_uring_sqe ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES );
+    if ( MAP_FAILED == sq || MAP_FAILED == cq || MAP_FAILED == uring.sqes )
+        goto fail;
+
+    uring.sq_head  = (unsigned *)( sq + params.sq_off.head );
+    uring.sq_tail  = (unsigned *)( sq + params.sq_off.tail );
+    uring.sq_mask  = (unsigned *)( sq + params.sq_off.ring_mask );
+    uring.sq_array = (unsigned *)( sq + params.sq_off.array );
+    uring.sq_entries = params.sq_entries;
+    uring.cq_head  = (unsigned *)( cq + params.cq_off.head );
+    uring.cq_tail  = (unsigned *)( cq + params.cq_off.tail );
+    uring.cq_mask  = (unsigned *)( cq + params.cq_off.ring_mask );
+    uring.cqes     = (struct io_uring_cqe *)( cq + params.cq_off.cqes );
+    uring.to_submit = 0;
+    uring.blocked = 0;
+
+    iov = calloc( buffers, sizeof( struct iovec ) );
+    files = calloc( file_count, sizeof( int ) );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        for ( j = 0 ; j < s->ring_slots ; ++j )
+        {
+            iov[ s->buf_base + j ].iov_base = s->ring[j].data;
+            iov[ s->buf_base + j ].iov_len = s->slot_size;
+        }
+
+        files[ s->file_base ] = s->input.watcher.fd;
+        for ( j = 0 ; j < s->output_count ; ++j )
+            files[ s->file_base + 1 + j ] = s->outputs[j].pipe.watcher.fd;
+    }
+
+    i = syscall( SYS_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iov, buffers );
+    if ( 0 <= i )
+        i = syscall( SYS_io_uring_register, uring.fd, IORING_REGISTER_FILES, files, file_count );
+
+    free( iov );
+    free( files );
+    if ( 0 > i )
+        goto fail;
+
+    fcntl( uring.fd, F_SETFD, FD_CLOEXEC );
+    return 1;
+
+fail:
+    fprintf(report, "{ \"posix_time\": %f, \"msg\": \"io_uring not supported, falling back to copy\", \"errno\": %d }\n", ev_time(), errno);
+    if ( 0 <= uring.fd )
+        close( uring.fd );
+    return 0;
+}
+
+static void uring_start()
+{
+    ev_io_init (&uring_watcher, uring_callback, uring.fd, EV_READ);
+    ev_io_start (loop, &uring_watcher);
+    ev_prepare_init (&uring_prepare, uring_submit_callback);
+    ev_prepare_start (loop, &uring_prepare);
+}
+
+// Register again the file behind a registered fd that now refers to another one
+static int uring_file_update(int index, int fd)
+{
+    struct io_uring_files_update update;
+
+    memset( &update, 0, sizeof( update ) );
+    update.offset = index;
+    update.fds = (unsigned long)&fd;
+    return 0 <= syscall( SYS_io_uring_register, uring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1 );
+}
+#else
+static int uring_setup()
+{
+    fprintf(report, "{ \"posix_time\": %f, \"msg\": \"io_uring not supported, falling back to copy\" }\n", ev_time());
+    return 0;
+}
+
+static void uring_start()
+{
+}
+
+static int uring_file_update(int index, int fd)
+{
+    return 0;
+}
+#endif
+
+// In threaded mode every stream gets a thread that reads its input and one
+// thread per output that writes it, all with blocking read(2) and write(2).
+// They share the ring without locks: the input thread alone fills slots and
+// bumps ring_count and the output counts, each output thread alone drains
+// its own tail, and the last output out of a slot frees it. A thread with
+// nothing to do sleeps on a futex. It sets its sleeping flag before it reads
+// the sequence number and checks the ring again, and the other side bumps the
+// sequence number before it checks the flag, so no wakeup gets lost and a
+// thread that is busy is never woken. The loop only drives the timer and
+// signals; a stream's last thread to exit wakes it with ev_async.
+// Time spent inside read(2) or write(2) counts as waiting.
+ev_async threads_done;
+
+static void futex_wait(int *addr, int value, const struct timespec *timeout)
+{
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0 );
+}
+
+static void futex_wake(int *addr)
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+}
+
+// Sleep on seq unless it has moved on since blocked() was last true
+static void thread_sleep(pipe_t *p, int *seq, int (*blocked)(void *), void *arg)
+{
+    int value;
+    __atomic_store_n( &p->sleeping, 1, __ATOMIC_SEQ_CST );
+    value = __atomic_load_n( seq, __ATOMIC_SEQ_CST );
+    if ( blocked( arg ) )
+        futex_wait( seq, value, NULL );
+    __atomic_store_n( &p->sleeping, 0, __ATOMIC_RELAXED );
+}
+
+static int input_blocked(void *arg)
+{
+    stream_t *s = (stream_t *)arg;
+    return !__atomic_load_n( &s->stop, __ATOMIC_SEQ_CST )
+        && s->ring_slots == __atomic_load_n( &s->ring_count, __ATOMIC_SEQ_CST );
+}
+
+static int output_blocked(void *arg)
+{
+    output_t *out = (output_t *)arg;
+    stream_t *s = out->stream;
+    return !__atomic_load_n( &s->stop, __ATOMIC_SEQ_CST )
+        && 0 < __atomic_load_n( &s->input_status, __ATOMIC_SEQ_CST )
+        && 0 == __atomic_load_n( &out->count, __ATOMIC_SEQ_CST );
+}
+
+// Tell the outputs about new slots or the end of the input
+static void wake_outputs(stream_t *s)
+{
+    int i;
+    __atomic_add_fetch( &s->head_seq, 1, __ATOMIC_SEQ_CST );
+    for ( i = 0 ; i < s->output_count ; ++i )
+        if ( __atomic_load_n( &s->outputs[i].pipe.sleeping, __ATOMIC_SEQ_CST ) )
+        {
+            futex_wake( &s->head_seq );
+            return;
+        }
+}
+
+static void wake_input(stream_t *s)
+{
+    __atomic_add_fetch( &s->tail_seq, 1, __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n( &s->input.sleeping, __ATOMIC_SEQ_CST ) )
+        futex_wake( &s->tail_seq );
+}
+
+// the thread may not have been stored yet if it failed right after it started
+static void thread_interrupt(pipe_t *p)
+{
+    pthread_t thread = __atomic_load_n( &p->thread, __ATOMIC_ACQUIRE );
+    if ( thread )
+        pthread_kill( thread, SIGUSR1 );
+}
+
+// Make every thread of s exit: wake the sleeping ones and interrupt the ones
+// blocked in read(2) or write(2). The timer repeats this until all are gone,
+// in case a signal arrived just before a thread entered the system call.
+static void threads_stop(stream_t *s)
+{
+    int i;
+    __atomic_store_n( &s->stop, 1, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch( &s->head_seq, 1, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch( &s->tail_seq, 1, __ATOMIC_SEQ_CST );
+    futex_wake( &s->head_seq );
+    futex_wake( &s->tail_seq );
+    thread_interrupt( &s->input );
+    for ( i = 0 ; i < s->output_count ; ++i )
+        thread_interrupt( &s->outputs[i].pipe );
+}
+
+static void thread_exit(stream_t *s)
+{
+    if ( 0 == __atomic_sub_fetch( &s->threads, 1, __ATOMIC_ACQ_REL ) )
+        ev_async_send( loop, &threads_done );
+}
+
+static void *input_thread(void *arg)
+{
+    stream_t *s = (stream_t *)arg;
+    slot_t *slot;
+    struct timespec timeout;
+    ev_tstamp delay;
+    int size, i, seq;
+
+    while ( !__atomic_load_n( &s->stop, __ATOMIC_ACQUIRE ) )
+    {
+        if ( s->ring_slots == __atomic_load_n( &s->ring_count, __ATOMIC_ACQUIRE ) )
+        {
+            thread_sleep( &s->input, &s->tail_seq, input_blocked, s );
+            continue;
+        }
+
+        // sleep off the rate limit, threads_stop still wakes us
+        if ( rate_limit && 0 < ( delay = rate_delay( s, ev_time() ) ) )
+        {
+            throttle_start( s, ev_time() );
+            timeout.tv_sec = delay;
+            timeout.tv_nsec = ( delay - timeout.tv_sec ) * 1e9;
+            seq = __atomic_load_n( &s->tail_seq, __ATOMIC_SEQ_CST );
+            if ( !__atomic_load_n( &s->stop, __ATOMIC_SEQ_CST ) )
+                futex_wait( &s->tail_seq, seq, &timeout );
+            continue;
+        }
+        throttle_stop( s, ev_time() );
+
+        slot = &s->ring[ s->ring_head ];
+        wait_start( &s->input, ev_time() );
+
+        // a FIFO reads as end of file until a writer opens it, so wait for
+        // data, or for a writer to come and go, as uring_update does
+        if ( s->wait_writer )
+        {
+            struct pollfd pfd = { s->input.watcher.fd, POLLIN, 0 };
+            if ( 0 > poll( &pfd, 1, -1 ) )
+            {
+                wait_stop( &s->input, ev_time() );
+                continue;
+            }
+            s->wait_writer = 0;
+        }
+
+        STAT_ADD( s->input.syscalls, 1 );
+        size = read( s->input.watcher.fd, slot->data, read_len( s ) );
+        wait_stop( &s->input, ev_time() );
+        if ( 0 > size && EINTR == errno )
+            continue;
+
+        if ( 0 >= size )
+        {
+            __atomic_store_n( &s->input_status, 0 == size ? 0 : -errno, __ATOMIC_SEQ_CST );
+            wake_outputs( s );
+            break;
+        }
+
+        STAT_ADD( s->bytes_in, size );
+        count_size( &s->input, size );
+        s->tokens -= size;
+        tune_read_size( s, size );
+        inspect_chunk( s, slot->data, size );
+        slot->size = size;
+        slot->refs = s->output_count;
+        s->ring_head = ( s->ring_head + 1 ) % s->ring_slots;
+        __atomic_add_fetch( &s->ring_count, 1, __ATOMIC_SEQ_CST );
+        for ( i = 0 ; i < s->output_count ; ++i )
+            __atomic_add_fetch( &s->outputs[i].count, 1, __ATOMIC_SEQ_CST );
+
+        wake_outputs( s );
+    }
+
+    thread_exit( s );
+    return NULL;
+}
+
+static void *output_thread(void *arg)
+{
+    output_t *out = (output_t *)arg;
+    stream_t *s = out->stream;
+    slot_t *slot;
+    int sent;
+
+    while ( !__atomic_load_n( &s->stop, __ATOMIC_ACQUIRE ) )
+    {
+        if ( 0 == __atomic_load_n( &out->count, __ATOMIC_ACQUIRE ) )
+        {
+            if ( 0 >= __atomic_load_n( &s->input_status, __ATOMIC_ACQUIRE ) && 0 == __atomic_load_n( &out->count, __ATOMIC_ACQUIRE ) )
+                break; // drained
+
+            thread_sleep( &out->pipe, &s->head_seq, output_blocked, out );
+            continue;
+        }
+
+        slot = &s->ring[ out->tail ];
+        wait_start( &out->pipe, ev_time() );
+        STAT_ADD( out->pipe.syscalls, 1 );
+        sent = write( out->pipe.watcher.fd, slot->data + out->offset, slot->size - out->offset );
+        wait_stop( &out->pipe, ev_time() );
+        if ( 0 > sent && EINTR == errno )
+            continue;
+
+        if ( 0 >= sent )
+        {
+            out->error = 0 > sent ? errno : EIO;
+            threads_stop( s );
+            break;
+        }
+
+        STAT_ADD( out->bytes_out, sent );
+        count_size( &out->pipe, sent );
+        out->offset += sent;
+        if ( out->offset < slot->size )
+            continue;
+
+        out->offset = 0;
+        out->tail = ( out->tail + 1 ) % s->ring_slots;
+        __atomic_sub_fetch( &out->count, 1, __ATOMIC_SEQ_CST );
+
+        // outputs write slots in order, so slots are freed in order too
+        if ( 0 == __atomic_sub_fetch( &slot->refs, 1, __ATOMIC_ACQ_REL ) )
+        {
+            __atomic_sub_fetch( &s->ring_count, 1, __ATOMIC_SEQ_CST );
+            wake_input( s );
+        }
+    }
+
+    thread_exit( s );
+    return NULL;
+}
+
+static void interrupt_handler(int sig)
+{
+}
+
+static void threads_start(stream_t *s)
+{
+    pthread_t thread;
+    sigset_t all, old;
+    int i;
+
+    // keep signals on the main thread, except the one that interrupts the
+    // threads' system calls
+    sigfillset( &all );
+    sigdelset( &all, SIGUSR1 );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+
+    s->threads = 1 + s->output_count;
+    if ( pthread_create( &thread, NULL, input_thread, s ) )
+        goto fail;
+    __atomic_store_n( &s->input.thread, thread, __ATOMIC_RELEASE );
+
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        if ( pthread_create( &thread, NULL, output_thread, &s->outputs[i] ) )
+            goto fail;
+        __atomic_store_n( &s->outputs[i].pipe.thread, thread, __ATOMIC_RELEASE );
+    }
+
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+    return;
+
+fail:
+    fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Could not start threads\" }\n", ev_time());
+    exit(1);
+}
+
+// The last thread of a stream is exiting. The threads are joinable so that
+// threads_stop can still signal them until they are joined here.
+static void threads_done_callback (EV_P_ ev_async *w, int revents)
+{
+    int i, j;
+
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        if ( s->done || s->no_readers || 0 != __atomic_load_n( &s->threads, __ATOMIC_ACQUIRE ) )
+            continue;
+
+        pthread_join( s->input.thread, NULL );
+        for ( j = 0 ; j < s->output_count ; ++j )
+            pthread_join( s->outputs[j].pipe.thread, NULL );
+
+        for ( j = 0 ; j < s->output_count && !s->outputs[j].error ; ++j )
+            ;
+
+        if ( j < s->output_count )
+        {
+            errno = s->outputs[j].error;
+            output_failed( &s->outputs[j] );
+        }
+        else
+            stream_finish( s );
+    }
+}
+
+static void timer_callback(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    int i, j;
+
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        int64_t bytes_out = STAT( s->outputs[0].bytes_out );
+        int ring_count = STAT( s->ring_count );
+        ev_tstamp throttled;
+        __atomic_load( &s->throttle_start, &throttled, __ATOMIC_ACQUIRE );
+        if ( s->done )
+            continue;
+
+        if ( STAT( s->stop ) )
+            threads_stop( s );
+
+        if ( s->last_bytes_out > 0 && s->last_bytes_out >= bytes_out && 0 > throttled )
+        {
+            print_start( s, ev_time() );
+            fprintf(report, "\"msg\": \"Stalled ");
+            if ( 0 == ring_count && !s->use_file )
+            {
+                fprintf(report, "reading from ");
+                print_string( s->name );
+            }
+            else if ( s->ring_slots == ring_count || s->use_file )
+            {
+                for ( j = 0 ; j < s->output_count - 1 && STAT( s->outputs[j].count ) != ring_count ; ++j )
+                    ;
+                fprintf(report, "writing to ");
+                print_string( s->outputs[j].name );
+            }
+            else
+            {
+                fprintf(report, "reading from ");
+                print_string( s->name );
+                fprintf(report, " and writing to ");
+                print_string( s->outputs[0].name );
+            }
+            fprintf(report, "\" }\n");
+        }
+
+        s->last_bytes_out = bytes_out;
+        report_periodic = 1;
+        print_timer( s );
+        report_periodic = 0;
+        stats_publish( s, 1 );
+    }
+}
+
+static void rates_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    int i;
+    for ( i = 0 ; i < stream_count ; ++i )
+        if ( !streams[i].done )
+            rate_sample( &streams[i], ev_now( loop ) );
+}
+
+// Threaded mode has no ring_update on the main thread to publish from
+static void stats_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    int i;
+    for ( i = 0 ; i < stream_count ; ++i )
+        if ( !streams[i].done )
+            stats_publish( &streams[i], 1 );
+}
+
+static void sigint_callback (struct ev_loop *loop, ev_signal *w, int revents)
+{
+    int i;
+    for ( i = 0 ; i < stream_count ; ++i )
+        if ( !streams[i].done )
+            print_timer( &streams[i] );
+
+    fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Success\", \"msg\": \"Received SIGINT\" }\n", ev_time() );
+    exit(0);
+}
+
+// stdin and stdout may be shared with other processes (e.g. a terminal), so
+// their original flags are put back when zpv exits. io_uring waits on
+// blocking fds by itself but fails requests on O_NONBLOCK ones with EAGAIN,
+// and the threads of threaded mode block, so in those modes the flag is
+// cleared instead.
+static void pipe_init(pipe_t *p, int fd, const char *name)
+{
+    int size;
+    p->time_waiting = 0;
+    p->timer_start = -1;
+    p->syscalls = 0;
+    p->pipe_size = 0 < ( size = fcntl( fd, F_GETPIPE_SZ ) ) ? size : 0;
+    p->watcher.fd = fd;
+    if ( -1 == ( p->flags = fcntl( fd, F_GETFL, 0 ) )
+        || -1 == fcntl( fd, F_SETFL, use_uring || use_threads ? p->flags & ~O_NONBLOCK : p->flags | O_NONBLOCK ) )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"msg\": \"Could not set the file status flags of ", ev_time());
+        print_string( name );
+        fprintf(report, "\", \"errno\": %d }\n", errno);
+    }
+}
+
+static void restore_flags()
+{
+    int i, j;
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        if ( s->done )
+            continue;
+
+        if ( -1 != s->input.flags )
+            fcntl( s->input.watcher.fd, F_SETFL, s->input.flags );
+
+        for ( j = 0 ; j < s->output_count ; ++j )
+            if ( -1 != s->outputs[j].pipe.flags )
+                fcntl( s->outputs[j].pipe.watcher.fd, F_SETFL, s->outputs[j].pipe.flags );
+    }
+}
+
+static void stats_unlink()
+{
+    unlink( stats_path );
+}
+
+// Create the stats segment with a record per stream. Without it zpv carries
+// on, only reporting on stderr.
+static void stats_setup(const char *mode)
+{
+    zpv_stats_stream_t *records;
+    int fd, i;
+
+    snprintf( stats_path, sizeof( stats_path ), ZPV_STATS_DIR "/" ZPV_STATS_PREFIX "%d", (int)getpid() );
+    stats_size = sizeof( zpv_stats_header_t ) + stream_count * sizeof( zpv_stats_stream_t );
+    fd = open( stats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( 0 > fd || 0 != ftruncate( fd, stats_size )
+        || MAP_FAILED == ( stats = mmap( NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"msg\": \"Could not create stats segment ", ev_time());
+        print_string( stats_path );
+        fprintf(report, "\", \"errno\": %d }\n", errno);
+        if ( 0 <= fd )
+        {
+            close( fd );
+            unlink( stats_path );
+        }
+        stats = NULL;
+        return;
+    }
+    close( fd );
+    atexit( stats_unlink );
+
+    stats->version = ZPV_STATS_VERSION;
+    stats->pid = getpid();
+    stats->stream_count = stream_count;
+    strncpy( stats->mode, mode, sizeof( stats->mode ) - 1 );
+    stats->start_time = start_time;
+    stats->rate_limit = rate_limit;
+
+    records = (zpv_stats_stream_t *)( stats + 1 );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        strncpy( records[i].id, s->id ? s->id : "", sizeof( records[i].id ) - 1 );
+        strncpy( records[i].name, s->name, sizeof( records[i].name ) - 1 );
+        records[i].output_count = s->output_count;
+        s->stats = &records[i];
+        stats_publish( s, 1 );
+    }
+
+    __atomic_store_n( &stats->magic, ZPV_STATS_MAGIC, __ATOMIC_RELEASE );
+}
+
+// With -M the counters are served in the Prometheus text format on a Unix
+// socket, from the event loop like everything else. All sockets are
+// non-blocking, at most METRICS_CLIENTS scrapers are served at once, and one
+// that does not finish within METRICS_TIMEOUT is dropped, so a slow scraper
+// costs the data path no more than a few short system calls.
+#define METRICS_CLIENTS 8
+#define METRICS_TIMEOUT 5.0
+#define METRICS_REQUEST_MAX 4096
+
+typedef struct
+{
+    ev_io watcher;
+    ev_timer timeout;
+    char request[ METRICS_REQUEST_MAX ];
+    int request_len;
+    char *response; // NULL until the request is in
+    size_t response_len;
+    size_t sent;
+} metrics_client_t;
+
+ev_io metrics_watcher;
+metrics_client_t metrics_clients[ METRICS_CLIENTS ];
+char metrics_path[ sizeof( ((struct sockaddr_un *)0)->sun_path ) ];
+
+// print s escaped for use inside a label value
+static void metrics_string(FILE *f, const char *s)
+{
+    for ( ; *s ; ++s )
+    {
+        if ( '"' == *s || '\\' == *s )
+            fprintf( f, "\\%c", *s );
+        else if ( '\n' == *s )
+            fprintf( f, "\\n" );
+        else
+            fputc( *s, f );
+    }
+}
+
+// Print a metric name with the labels of s and out, both optional
+static void metrics_name(FILE *f, const char *name, stream_t *s, output_t *out, const char *quantile)
+{
+    const char *sep = "{";
+    fprintf( f, "%s", name );
+    if ( s && s->id )
+    {
+        fprintf( f, "%sstream=\"", sep );
+        metrics_string( f, s->id );
+        fprintf( f, "\"" );
+        sep = ",";
+    }
+    if ( out )
+    {
+        fprintf( f, "%soutput=\"", sep );
+        metrics_string( f, out->name );
+        fprintf( f, "\"" );
+        sep = ",";
+    }
+    if ( quantile )
+    {
+        fprintf( f, "%squantile=\"%s\"", sep, quantile );
+        sep = ",";
+    }
+    if ( ',' == *sep )
+        fprintf( f, "}" );
+}
+
+static void metrics_header(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf( f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+}
+
+static void metrics_summary(FILE *f, const char *name, stream_t *s, output_t *out, pipe_t *p)
+{
+    static const char *quantiles[] = { "0.5", "0.9", "0.99", "1" };
+    int64_t counts[ HIST_BUCKETS ], total;
+    uint64_t us[ HIST_PERCENTILES ];
+    char suffixed[64];
+    int i;
+
+    for ( i = 0 ; i < HIST_BUCKETS ; ++i )
+        counts[i] = STAT( p->waits[i] );
+    total = hist_percentiles( counts, us );
+
+    for ( i = 0 ; i < HIST_PERCENTILES ; ++i )
+    {
+        metrics_name( f, name, s, out, quantiles[i] );
+        fprintf( f, " %g\n", us[i] / 1e6 );
+    }
+    snprintf( suffixed, sizeof( suffixed ), "%s_count", name );
+    metrics_name( f, suffixed, s, out, NULL );
+    fprintf( f, " %lld\n", (long long)total );
+}
+
+// Write the metrics into f. Every family lists all streams before the next
+// family starts, as the format requires.
+static void metrics_render(FILE *f)
+{
+    ev_tstamp now = ev_time();
+    struct rusage usage;
+    int i, j;
+
+    metrics_header( f, "zpv_start_time_seconds", "gauge", "Posix time zpv started." );
+    fprintf( f, "zpv_start_time_seconds %f\n", start_time );
+
+    getrusage( RUSAGE_SELF, &usage );
+    metrics_header( f, "zpv_cpu_seconds_total", "counter", "CPU time zpv used." );
+    fprintf( f, "zpv_cpu_seconds_total{mode=\"user\"} %ld.%06ld\n", (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec );
+    fprintf( f, "zpv_cpu_seconds_total{mode=\"system\"} %ld.%06ld\n", (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec );
+
+    metrics_header( f, "zpv_loop_iterations_total", "counter", "Event loop iterations." );
+    fprintf( f, "zpv_loop_iterations_total %u\n", ev_iteration( loop ) );
+
+    metrics_header( f, "zpv_stream_up", "gauge", "1 while the stream runs, 0 once it has ended." );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        metrics_name( f, "zpv_stream_up", &streams[i], NULL, NULL );
+        fprintf( f, " %d\n", !streams[i].done );
+    }
+
+    metrics_header( f, "zpv_bytes_in_total", "counter", "Bytes read from the input." );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        metrics_name( f, "zpv_bytes_in_total", &streams[i], NULL, NULL );
+        fprintf( f, " %lld\n", (long long)STAT( streams[i].bytes_in ) );
+    }
+
+    if ( 0 <= record_delim )
+    {
+        metrics_header( f, "zpv_records_total", "counter", "Records read from the input." );
+        for ( i = 0 ; i < stream_count ; ++i )
+        {
+            metrics_name( f, "zpv_records_total", &streams[i], NULL, NULL );
+            fprintf( f, " %lld\n", (long long)STAT( streams[i].records ) );
+        }
+    }
+
+    metrics_header( f, "zpv_bytes_out_total", "counter", "Bytes written to the output." );
+    for ( i = 0 ; i < stream_count ; ++i )
+        for ( j = 0 ; j < streams[i].output_count ; ++j )
+        {
+            metrics_name( f, "zpv_bytes_out_total", &streams[i], &streams[i].outputs[j], NULL );
+            fprintf( f, " %lld\n", (long long)STAT( streams[i].outputs[j].bytes_out ) );
+        }
+
+    metrics_header( f, "zpv_reads_total", "counter", "Read system calls on the input." );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        metrics_name( f, "zpv_reads_total", &streams[i], NULL, NULL );
+        fprintf( f, " %lld\n", (long long)STAT( streams[i].input.syscalls ) );
+    }
+
+    metrics_header( f, "zpv_writes_total", "counter", "Write system calls on the output." );
+    for ( i = 0 ; i < stream_count ; ++i )
+        for ( j = 0 ; j < streams[i].output_count ; ++j )
+        {
+            metrics_name( f, "zpv_writes_total", &streams[i], &streams[i].outputs[j], NULL );
+            fprintf( f, " %lld\n", (long long)STAT( streams[i].outputs[j].pipe.syscalls ) );
+        }
+
+    metrics_header( f, "zpv_input_wait_seconds_total", "counter", "Time the buffer was empty, waiting for the input." );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        metrics_name( f, "zpv_input_wait_seconds_total", &streams[i], NULL, NULL );
+        fprintf( f, " %f\n", time_waiting( &streams[i].input, now ) );
+    }
+
+    metrics_header( f, "zpv_output_wait_seconds_total", "counter", "Time the buffer was full, waiting for the output." );
+    for ( i = 0 ; i < stream_count ; ++i )
+        for ( j = 0 ; j < streams[i].output_count ; ++j )
+        {
+            metrics_name( f, "zpv_output_wait_seconds_total", &streams[i], &streams[i].outputs[j], NULL );
+            fprintf( f, " %f\n", time_waiting( &streams[i].outputs[j].pipe, now ) );
+        }
+
+    metrics_header( f, "zpv_input_wait_episode_seconds", "summary", "Length of the individual waits for the input." );
+    for ( i = 0 ; i < stream_count ; ++i )
+        metrics_summary( f, "zpv_input_wait_episode_seconds", &streams[i], NULL, &streams[i].input );
+
+    metrics_header( f, "zpv_output_wait_episode_seconds", "summary", "Length of the individual waits for the output." );
+    for ( i = 0 ; i < stream_count ; ++i )
+        for ( j = 0 ; j < streams[i].output_count ; ++j )
+            metrics_summary( f, "zpv_output_wait_episode_seconds", &streams[i], &streams[i].outputs[j], &streams[i].outputs[j].pipe );
+
+    if ( rate_limit )
+    {
+        metrics_header( f, "zpv_throttled_seconds_total", "counter", "Time reading was held back by the rate limit." );
+        for ( i = 0 ; i < stream_count ; ++i )
+        {
+            metrics_name( f, "zpv_throttled_seconds_total", &streams[i], NULL, NULL );
+            fprintf( f, " %f\n", time_throttled( &streams[i], now ) );
+        }
+    }
+
+    metrics_header( f, "zpv_read_size_bytes", "gauge", "Bytes currently requested per read." );
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        metrics_name( f, "zpv_read_size_bytes", &streams[i], NULL, NULL );
+        fprintf( f, " %d\n", STAT( streams[i].read_size ) );
+    }
+}
+
+static void metrics_close(metrics_client_t *c)
+{
+    ev_io_stop( loop, &c->watcher );
+    ev_timer_stop( loop, &c->timeout );
+    close( c->watcher.fd );
+    c->watcher.fd = -1;
+    free( c->response );
+    c->response = NULL;
+}
+
+// Render the whole response up front, into a buffer sized for the streams
+// there are, so writing it out needs no more work from the loop
+static void metrics_respond(metrics_client_t *c)
+{
+    size_t size = 0, header;
+    char *body = NULL;
+    FILE *f;
+    int failed;
+
+    // the body grows as needed, however long the stream ids and names are
+    if ( !( f = open_memstream( &body, &size ) ) )
+    {
+        metrics_close( c );
+        return;
+    }
+    metrics_render( f );
+    failed = ferror( f );
+    if ( fclose( f ) || failed || !body )
+    {
+        free( body );
+        metrics_close( c );
+        return;
+    }
+
+    header = 128;
+    if ( !( c->response = malloc( header + size ) ) )
+    {
+        free( body );
+        metrics_close( c );
+        return;
+    }
+    header = snprintf( c->response, header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", size );
+    memcpy( c->response + header, body, size );
+    free( body );
+    c->response_len = header + size;
+    c->sent = 0;
+
+    ev_io_stop( loop, &c->watcher );
+    ev_io_set( &c->watcher, c->watcher.fd, EV_WRITE );
+    ev_io_start( loop, &c->watcher );
+}
+
+static void metrics_client_callback (EV_P_ ev_io *w, int revents)
+{
+    metrics_client_t *c = (metrics_client_t *)w->data;
+    ssize_t size;
+
+    if ( !c->response )
+    {
+        size = read( w->fd, c->request + c->request_len, sizeof( c->request ) - 1 - c->request_len );
+        if ( 0 > size && EAGAIN == errno )
+            ev_io_drained( loop, w, EV_READ );
+        if ( 0 > size && ( EAGAIN == errno || EINTR == errno ) )
+            return;
+        if ( 0 >= size )
+        {
+            metrics_close( c );
+            return;
+        }
+        c->request_len += size;
+        c->request[ c->request_len ] = 0;
+        // any request gets the metrics, once its header is complete
+        if ( strstr( c->request, "\r\n\r\n" ) || strstr( c->request, "\n\n" ) || sizeof( c->request ) - 1 == c->request_len )
+            metrics_respond( c );
+        return;
+    }
+
+    size = send( w->fd, c->response + c->sent, c->response_len - c->sent, MSG_NOSIGNAL );
+    if ( 0 > size && EAGAIN == errno )
+        ev_io_drained( loop, w, EV_WRITE );
+    if ( 0 > size && ( EAGAIN == errno || EINTR == errno ) )
+        return;
+    if ( 0 > size || ( c->sent += size ) == c->response_len )
+        metrics_close( c );
+}
+
+static void metrics_timeout_callback (EV_P_ ev_timer *w, int revents)
+{
+    metrics_close( (metrics_client_t *)w->data );
+}
+
+static void metrics_accept_callback (EV_P_ ev_io *w, int revents)
+{
+    metrics_client_t *c;
+    int fd, i;
+
+    while ( 0 <= ( fd = accept4( w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) )
+    {
+        for ( i = 0 ; i < METRICS_CLIENTS && 0 <= metrics_clients[i].watcher.fd ; ++i )
+            ;
+
+        // too many scrapers at once, turn this one away
+        if ( METRICS_CLIENTS == i )
+        {
+            close( fd );
+            continue;
+        }
+
+        c = &metrics_clients[i];
+        c->request_len = 0;
+        ev_io_init (&c->watcher, metrics_client_callback, fd, EV_READ);
+        c->watcher.data = c;
+        ev_io_start (loop, &c->watcher);
+        ev_timer_init (&c->timeout, metrics_timeout_callback, METRICS_TIMEOUT, 0);
+        c->timeout.data = c;
+        ev_timer_start (loop, &c->timeout);
+    }
+
+    if ( EAGAIN == errno || EWOULDBLOCK == errno )
+        ev_io_drained( loop, w, EV_READ );
+}
+
+static void metrics_unlink()
+{
+    unlink( metrics_path );
+}
+
+// Listen on path, replacing a socket a previous zpv may have left behind
+static int metrics_setup(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd, i;
+
+    if ( strlen( path ) >= sizeof( addr.sun_path ) )
+    {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    if ( 0 == lstat( path, &st ) && S_ISSOCK( st.st_mode ) )
+        unlink( path );
+
+    if ( 0 > ( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) )
+        || 0 != bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) || 0 != listen( fd, METRICS_CLIENTS ) )
+    {
+        if ( 0 <= fd )
+            close( fd );
+        return 0;
+    }
+
+    strcpy( metrics_path, path );
+    atexit( metrics_unlink );
+    for ( i = 0 ; i < METRICS_CLIENTS ; ++i )
+        metrics_clients[i].watcher.fd = -1;
+
+    ev_io_init (&metrics_watcher, metrics_accept_callback, fd, EV_READ);
+    ev_io_start (loop, &metrics_watcher);
+    return 1;
+}
+
+static int open_check(const char *what, const char *name, int fd)
+{
+    if ( 0 > fd || -1 == fcntl( fd, F_GETFL, 0 ) )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Could not open %s ", ev_time(), what);
+        print_string( name );
+        fprintf(report, "\", \"errno\": %d }\n", errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int output_add(stream_t *s, const char *name, int fd)
+{
+    output_t *out;
+
+    if ( MAX_OUTPUTS == s->output_count )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Too many outputs\" }\n", ev_time());
+        return 0;
+    }
+
+    if ( !open_check( "output", name, fd ) )
+        return 0;
+
+    s->outputs = realloc( s->outputs, ( s->output_count + 1 ) * sizeof( output_t ) );
+    out = &s->outputs[ s->output_count++ ];
+    memset( out, 0, sizeof( *out ) );
+    out->name = name;
+    out->pipe.flags = -1;
+    out->pipe.watcher.fd = fd;
+    return 1;
+}
+
+// Add a stream reading from fd. The pointer returned is good until the next
+// stream is added.
+static stream_t *stream_add(const char *id, const char *name, int fd)
+{
+    stream_t *s;
+
+    if ( !open_check( "input", name, fd ) )
+        return NULL;
+
+    streams = realloc( streams, ( stream_count + 1 ) * sizeof( stream_t ) );
+    s = &streams[ stream_count++ ];
+    memset( s, 0, sizeof( *s ) );
+    s->id = id;
+    s->name = name;
+    s->input.flags = -1;
+    s->input.watcher.fd = fd;
+    return s;
+}
+
+// Read the streams of a multi-stream run from path, one per line:
+//   <id> <input> <output> [<output>...]
+// Empty lines and lines starting with # are skipped. Inputs are opened
+// without blocking, outputs the same way as with -o.
+static int read_streams(const char *path)
+{
+    const char *space = " \t\r\n";
+    char line[4096], *id, *name;
+    FILE *f;
+    stream_t *s;
+    int ok = 1, fd, no_reader;
+
+    if ( !( f = fopen( path, "r" ) ) )
+        return open_check( "stream list", path, -1 );
+
+    while ( ok && fgets( line, sizeof( line ), f ) )
+    {
+        // the rest of a longer line would read as a stream of its own
+        if ( !strchr( line, '\n' ) && EOF != getc( f ) )
+        {
+            fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Line longer than %d bytes in ", ev_time(), (int)sizeof( line ) - 2);
+            print_string( path );
+            fprintf(report, "\" }\n");
+            ok = 0;
+            break;
+        }
+
+        if ( !( id = strtok( line, space ) ) || '#' == *id )
+            continue;
+
+        name = strtok( NULL, space );
+        ok = name && ( s = stream_add( strdup( id ), strdup( name ), open( name, O_RDONLY | O_NONBLOCK | O_CLOEXEC ) ) );
+        while ( ok && ( name = strtok( NULL, space ) ) )
+        {
+            // a FIFO without a reader would block here, and every stream
+            // after it with it. /dev/null keeps its fd until a reader comes.
+            fd = open( name, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0666 );
+            no_reader = 0 > fd && ENXIO == errno;
+            if ( no_reader )
+                fd = open( "/dev/null", O_WRONLY | O_CLOEXEC );
+
+            ok = output_add( s, strdup( name ), fd );
+            if ( ok && no_reader )
+            {
+                s->outputs[ s->output_count - 1 ].no_reader = 1;
+                ++s->no_readers;
+            }
+        }
+
+        if ( ok && 0 == s->output_count )
+        {
+            fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Stream ", ev_time());
+            print_string( id );
+            fprintf(report, " has no outputs\" }\n");
+            ok = 0;
+        }
+    }
+
+    fclose( f );
+    if ( ok && 0 == stream_count )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"No streams in ", ev_time());
+        print_string( path );
+        fprintf(report, "\" }\n");
+        ok = 0;
+    }
+
+    return ok;
+}
+
+// Create the staging pipes and size all kernel pipes so that a full ring
+// fits. A chunk may straddle two pages, so ask for twice the ring size, then
+// less until the kernel agrees (see /proc/sys/fs/pipe-max-size). If the pipes
+// end up smaller, the ring shrinks to what they can hold.
+static long splice_setup(stream_t *s, long ring_size)
+{
+    int i, size, capacity = INT_MAX;
+
+    for ( i = 0 ; i <= s->output_count ; ++i )
+    {
+        int *p = i ? s->outputs[i - 1].stage : s->splice_pipe;
+        if ( 1 == s->output_count && i )
+        {
+            p[0] = s->splice_pipe[0];
+            p[1] = s->splice_pipe[1];
+            continue;
+        }
+
+        if ( i && 0 != pipe2( p, O_NONBLOCK | O_CLOEXEC ) )
+            splice_error( s, "Could not create staging pipe" );
+
+        for ( size = 2 * ring_size ; BUFFER_SIZE < size && 0 > fcntl( p[1], F_SETPIPE_SZ, size ) ; size /= 2 )
+            ;
+
+        if ( 0 < ( size = fcntl( p[1], F_GETPIPE_SZ ) ) && size < capacity )
+            capacity = size;
+    }
+
+    if ( capacity / 2 < ring_size )
+    {
+        ring_size = capacity / 2;
+        if ( s->ring_slots > ring_size / BUFFER_SIZE )
+            s->ring_slots = BUFFER_SIZE > ring_size ? 1 : ring_size / BUFFER_SIZE;
+
+        print_start( s, ev_time() );
+        fprintf(report, "\"msg\": \"Pipe capacity limited, buffer reduced to %ld bytes in %d slots\" }\n", ring_size, s->ring_slots);
+    }
+
+    return ring_size;
+}
+
+// Allocate the ring of s, and its kernel pipes in splice mode
+static void stream_init(stream_t *s, int splice, long ring_size, int ring_slots)
+{
+    int i;
+
+    s->use_splice = splice;
+    s->ring_slots = ring_slots;
+    if ( s->use_splice && 0 != pipe( s->splice_pipe ) )
+    {
+        print_start( s, ev_time() );
+        fprintf(report, "\"msg\": \"Could not create splice pipe\", \"errno\": %d }\n", errno);
+        s->use_splice = 0;
+    }
+
+    if ( s->use_splice )
+        ring_size = splice_setup( s, ring_size );
+
+    s->slot_size = ring_size / s->ring_slots;
+    s->read_size = BUFFER_SIZE < s->slot_size ? BUFFER_SIZE : s->slot_size;
+    s->ring = calloc( s->ring_slots, sizeof( slot_t ) );
+    for ( i = 0 ; i < s->ring_slots ; ++i )
+        s->ring[ i ].data = malloc( s->slot_size );
+
+    s->input_status = 1;
+}
+
+static void refill_callback (EV_P_ ev_timer *w, int revents)
+{
+    ring_update( (stream_t *)w->data );
+}
+
+static void stream_start(stream_t *s)
+{
+    struct stat st;
+    off_t pos = 0;
+    int i;
+
+    pipe_init( &s->input, s->input.watcher.fd, s->name );
+    ev_io_init (&s->input.watcher, input_callback, s->input.watcher.fd, EV_READ);
+    s->input.watcher.data = s;
+    s->wait_writer = s->id && 0 == fstat( s->input.watcher.fd, &st ) && S_ISFIFO( st.st_mode );
+    s->tokens = rate_burst();
+    s->refilled = ev_time();
+    s->throttle_start = -1;
+    s->size = size_hint;
+    s->records_time = start_time;
+    sha256_init( &s->sha256 );
+    if ( 0 == fstat( s->input.watcher.fd, &st ) && S_ISREG( st.st_mode ) )
+    {
+        pos = lseek( s->input.watcher.fd, 0, SEEK_CUR );
+        if ( 0 > s->size )
+            s->size = st.st_size - pos;
+
+        // the other modes, the rate limit, the digests and the record count
+        // need the data to pass the ring
+        s->use_file = !s->use_splice && !use_uring && !use_threads && !rate_limit && !hashes && 0 > record_delim && 0 <= pos;
+    }
+    rate_sample( s, ev_time() );
+    ev_init (&s->refill, refill_callback);
+    s->refill.data = s;
+    for ( i = 0 ; i < s->output_count ; ++i )
+    {
+        output_t *out = &s->outputs[i];
+        out->stream = s;
+        pipe_init( &out->pipe, out->pipe.watcher.fd, out->name );
+        ev_io_init (&out->pipe.watcher, output_callback, out->pipe.watcher.fd, EV_WRITE);
+        out->pipe.watcher.data = out;
+        out->file_pos = pos;
+        out->copy_range = 0 == fstat( out->pipe.watcher.fd, &st ) && S_ISREG( st.st_mode );
+    }
+}
+
+// Try the output FIFOs that had no reader again, and start the streams
+// whose outputs are all open now
+static void readers_callback (EV_P_ ev_timer *w, int revents)
+{
+    int i, j, fd, opened, waiting = 0;
+
+    for ( i = 0 ; i < stream_count ; ++i )
+    {
+        stream_t *s = &streams[i];
+        opened = 0;
+        for ( j = 0 ; j < s->output_count && !s->done ; ++j )
+        {
+            output_t *out = &s->outputs[j];
+            if ( !out->no_reader )
+                continue;
+
+            if ( 0 > ( fd = open( out->name, O_WRONLY | O_NONBLOCK | O_CLOEXEC ) ) )
+            {
+                if ( ENXIO != errno )
+                    output_failed( out );
+                continue;
+            }
+
+            // the fd keeps its number, which the stream and io_uring know it by
+            dup3( fd, out->pipe.watcher.fd, O_CLOEXEC );
+            close( fd );
+            pipe_init( &out->pipe, out->pipe.watcher.fd, out->name );
+            out->copy_range = 0;
+            out->no_reader = 0;
+            --s->no_readers;
+            opened = 1;
+            if ( use_uring && !uring_file_update( s->file_base + 1 + j, out->pipe.watcher.fd ) )
+                output_failed( out );
+        }
+
+        if ( s->done || s->no_readers )
+        {
+            waiting += !s->done;
+            continue;
+        }
+
+        if ( !opened )
+            continue;
+        if ( use_threads )
+            threads_start( s );
+        else
+            ring_update( s );
+    }
+
+    if ( !waiting )
+        ev_timer_stop( loop, w );
+}
+
+static unsigned int backend_from_name(const char *name)
+{
+    if ( !strcmp( name, "select" ) ) return EVBACKEND_SELECT;
+    if ( !strcmp( name, "poll" ) )   return EVBACKEND_POLL;
+    if ( !strcmp( name, "epoll" ) )  return EVBACKEND_EPOLL;
+    if ( !strcmp( name, "iouring" ) ) return EVBACKEND_IOURING;
+    return 0;
+}
+
+static int hash_from_name(const char *name)
+{
+    if ( !strcmp( name, "crc32c" ) ) return HASH_CRC32C;
+    if ( !strcmp( name, "sha256" ) ) return HASH_SHA256;
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s | -u | -t] [-B bytes] [-n slots] [-P bytes] [-L rate] [-b backend] [-E] [-S] [-M socket] [-z bytes] [-H hash]... [-l] [-d delim] [-i seconds] [-F format] [-o file]... [-O fd]...\n"
+        "       %s [-s | -u | -t] [-B bytes] [-n slots] [-P bytes] [-L rate] [-b backend] [-E] [-S] [-M socket] [-z bytes] [-H hash]... [-l] [-d delim] [-i seconds] [-F format] -m list\n"
+        "  -s  zero-copy mode: forward data with splice(2), falling back to read/write\n"
+        "  -u  io_uring mode: submit reads and writes on an io_uring with registered buffers\n"
+        "  -t  threaded mode: read and write on threads of their own, with blocking I/O\n"
+        "  -B  total buffer size in bytes, per stream (default %d)\n"
+        "  -n  number of buffer slots the total size is split into (default %d),\n"
+        "      reads grow up to the slot size\n"
+        "  -P  largest capacity stdin/stdout pipes may be grown to, 0 to never resize (default %d)\n"
+        "  -L  limit every stream to this many bytes per second\n"
+        "  -b  event loop backend: select, poll, epoll or iouring (default: best available)\n"
+        "  -E  epoll: keep the fds registered edge-triggered instead of adding and removing them\n"
+        "  -S  publish live counters in " ZPV_STATS_DIR "/" ZPV_STATS_PREFIX "<pid>, see zpvstat\n"
+        "  -M  serve Prometheus metrics on this Unix socket\n"
+        "  -z  size of the input in bytes, for the ETA when it is not a regular file\n"
+        "  -H  print this digest of the stream when it ends: crc32c or sha256, not with -s\n"
+        "  -l  count lines and report records and records per second, not with -s\n"
+        "  -d  count records ending in this byte instead, a character or a number (implies -l)\n"
+        "  -i  seconds between reports (default %g)\n"
+        "  -F  report format: json, csv or binary (default json)\n"
+        "  -o  also write the stream to this file or FIFO\n"
+        "  -O  also write the stream to this inherited file descriptor\n"
+        "  -m  copy the streams in this file instead of stdin, one per line:\n"
+        "      <id> <input> <output> [<output>...]\n",
+        name, name, DEFAULT_RING_SIZE, DEFAULT_RING_SLOTS, DEFAULT_PIPE_MAX, DEFAULT_REPORT_INTERVAL);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, splice = 0, use_stats = 0;
+    unsigned int backend = ev_recommended_backends(), loop_flags = 0;
+    long ring_size = DEFAULT_RING_SIZE;
+    int ring_slots = DEFAULT_RING_SLOTS;
+    const char *list = NULL, *metrics = NULL;
+    char *end;
+    stream_t *s;
+    use_uring = 0;
+    use_threads = 0;
+    pipe_max = DEFAULT_PIPE_MAX;
+    size_hint = -1;
+    record_delim = -1;
+    report_setup();
+    if ( !( s = stream_add( NULL, "stdin", STDIN_FILENO ) ) || !output_add( s, "stdout", STDOUT_FILENO ) )
+        return 1;
+
+    while ( -1 != ( opt = getopt( argc, argv, "sutSlEB:n:P:L:b:M:z:H:d:i:F:o:O:m:" ) ) )
+    {
+        switch ( opt )
+        {
+        case 's': splice = 1; break;
+        case 'u': use_uring = 1; break;
+        case 't': use_threads = 1; break;
+        case 'S': use_stats = 1; break;
+        case 'E': loop_flags |= EVFLAG_STICKY; break;
+        case 'B': ring_size = strtol( optarg, NULL, 0 ); break;
+        case 'n': ring_slots = atoi( optarg ); break;
+        case 'P': pipe_max = atoi( optarg ); break;
+        case 'L': rate_limit = strtoll( optarg, NULL, 0 ); break;
+        case 'm': list = optarg; break;
+        case 'M': metrics = optarg; break;
+        case 'z': size_hint = strtoll( optarg, NULL, 0 ); break;
+        case 'l':
+            if ( 0 > record_delim )
+                record_delim = '\n';
+            break;
+        case 'd':
+            record_delim = 1 == strlen( optarg ) ? (unsigned char)optarg[0] : strtol( optarg, &end, 0 );
+            if ( !*optarg || ( 1 < strlen( optarg ) && *end ) || 0 > record_delim || 255 < record_delim )
+            {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 'i': report_interval = atof( optarg ); break;
+        case 'F':
+            if ( 0 > ( report_format = report_format_from_name( optarg ) ) )
+            {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 'H':
+            if ( !( opt = hash_from_name( optarg ) ) )
+            {
+                usage( argv[0] );
+                return 1;
+            }
+            hashes |= opt;
+            break;
+        case 'b':
+            if ( !( backend = backend_from_name( optarg ) ) )
+            {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 'o':
+            if ( !output_add( s, optarg, open( optarg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 ) ) )
+                return 1;
+            break;
+        case 'O':
+            if ( !output_add( s, optarg, atoi( optarg ) ) )
+                return 1;
+            break;
+        default: usage( argv[0] ); return 1;
+        }
+    }
+
+    if ( 0 >= ring_slots || ring_size < ring_slots || 0 > rate_limit || INT_MAX < ring_size / ring_slots
+        || 1 < splice + use_uring + use_threads || ( list && 1 < s->output_count ) || ( splice && ( hashes || 0 <= record_delim ) ) || 0 >= report_interval )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    // the streams in the list replace stdin and stdout
+    if ( list )
+    {
+        free( s->outputs );
+        stream_count = 0;
+        if ( !read_streams( list ) )
+            return 1;
+
+        // a consumer going away ends its stream, not all of them
+        signal( SIGPIPE, SIG_IGN );
+    }
+
+    hash_init();
+    records_init();
+    for ( i = 0 ; i < stream_count ; ++i )
+        stream_init( &streams[i], splice, ring_size, ring_slots );
+
+    if ( use_uring && !uring_setup() )
+        use_uring = 0;
+
+    // many streams mean many timers that keep being restarted, the wheel
+    // makes that O(1) for all but the short ones
+    if ( list )
+        loop_flags |= EVFLAG_TIMERWHEEL;
+
+    if ( !( loop = ev_loop_new( backend | loop_flags ) ) )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Could not initialize event loop\" }\n", ev_time());
+        return 1;
+    }
+    start_time = ev_time();
+
+    for ( i = 0 ; i < stream_count ; ++i )
+        stream_start( &streams[i] );
+
+    if ( metrics && !metrics_setup( metrics ) )
+    {
+        fprintf(report, "{ \"posix_time\": %f, \"exit_status\": \"Error\",  \"msg\": \"Could not listen on ", ev_time());
+        print_string( metrics );
+        fprintf(report, "\", \"errno\": %d }\n", errno);
+        return 1;
+    }
+
+    if ( use_stats )
+        stats_setup( use_threads ? "threads" : use_uring ? "iouring" : splice ? "splice" : "copy" );
+
+    atexit( restore_flags );
+    if ( use_uring )
+        uring_start();
+
+    streams_active = stream_count;
+    exit_status = 0;
+    if ( !use_threads )
+        for ( i = 0 ; i < stream_count ; ++i )
+            if ( !streams[i].no_readers )
+                ring_update( &streams[i] );
+
+    for ( i = 0 ; i < stream_count && !streams[i].no_readers ; ++i )
+        ;
+    if ( i < stream_count )
+    {
+        ev_timer_init (&readers_timer, readers_callback, READER_RETRY, READER_RETRY);
+        ev_timer_start (loop, &readers_timer);
+    }
+
+    ev_timer_init (&timer, timer_callback, report_interval, report_interval);
+    ev_timer_start (loop, &timer);
+
+    ev_timer_init (&rates_timer, rates_timer_callback, 1.0, 1.0);
+    ev_timer_start (loop, &rates_timer);
+
+    ev_signal_init (&exitsig, sigint_callback, SIGINT);
+    ev_signal_start (loop, &exitsig);
+
+    if ( use_threads )
+    {
+        struct sigaction sa;
+        memset( &sa, 0, sizeof( sa ) );
+        sa.sa_handler = interrupt_handler; // no SA_RESTART, blocked calls return EINTR
+        sigaction( SIGUSR1, &sa, NULL );
+
+        ev_async_init (&threads_done, threads_done_callback);
+        ev_async_start (loop, &threads_done);
+        if ( stats )
+        {
+            ev_timer_init (&stats_timer, stats_timer_callback, STATS_INTERVAL, STATS_INTERVAL);
+            ev_timer_start (loop, &stats_timer);
+        }
+        for ( i = 0 ; i < stream_count ; ++i )
+            if ( !streams[i].no_readers )
+                threads_start( &streams[i] );
+    }
+
+    if ( REPORT_CSV == report_format )
+        report_csv_header();
+    for ( i = 0 ; i < stream_count ; ++i )
+        print_timer( &streams[i] );
 
-    print_timer();
     ev_run (loop, 0);
 }
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Copies three FIFOs with zpv -m in each mode. zpv opens the FIFOs before
+# any writer does, and the writers only attach a second later, so a stream
+# that takes the missing writer for end of file ends empty and its writer
+# blocks until the timeout.
+#
+# Then each mode again with the output of the first stream a FIFO whose
+# reader only comes two seconds later. The other streams must be done by
+# then instead of waiting for zpv to open it.
+#
+#   test/multistream-fifo.sh [zpv]
+
+zpv=${1:-./zpv}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+for i in 1 2 3; do
+    head -c $(( i * 1000000 )) /dev/urandom > "$dir/data$i"
+done
+
+for mode in "" -t -u; do
+    : > "$dir/list"
+    for i in 1 2 3; do
+        rm -f "$dir/in$i" "$dir/out$i"
+        mkfifo "$dir/in$i"
+        echo "s$i $dir/in$i $dir/out$i" >> "$dir/list"
+    done
+
+    timeout 20 "$zpv" $mode -m "$dir/list" 2> "$dir/stderr" &
+    zpv_pid=$!
+    sleep 1
+    for i in 1 2 3; do
+        timeout 20 sh -c "cat '$dir/data$i' > '$dir/in$i'" &
+    done
+
+    wait $zpv_pid
+    status=$?
+    wait
+    for i in 1 2 3; do
+        cmp -s "$dir/data$i" "$dir/out$i" || status="stream s$i differs"
+    done
+
+    if [ "$status" = 0 ]; then
+        echo "ok zpv $mode -m"
+    else
+        echo "FAILED zpv $mode -m: $status"
+        tail -n 3 "$dir/stderr"
+        failed=1
+    fi
+done
+
+for mode in "" -t -u; do
+    rm -f "$dir/out1" "$dir/out2" "$dir/out3" "$dir/copy1"
+    mkfifo "$dir/out1"
+    : > "$dir/list"
+    for i in 1 2 3; do
+        echo "s$i $dir/data$i $dir/out$i" >> "$dir/list"
+    done
+
+    timeout 20 "$zpv" $mode -m "$dir/list" 2> "$dir/stderr" &
+    zpv_pid=$!
+    sleep 2
+    status=0
+    for i in 2 3; do
+        cmp -s "$dir/data$i" "$dir/out$i" || status="stream s$i waited for the reader of out1"
+    done
+    timeout 20 cat "$dir/out1" > "$dir/copy1" &
+
+    wait $zpv_pid
+    zpv_status=$?
+    [ "$status" = 0 ] && status=$zpv_status
+    wait
+    cmp -s "$dir/data1" "$dir/copy1" || status="stream s1 differs"
+
+    if [ "$status" = 0 ]; then
+        echo "ok zpv $mode -m, late output reader"
+    else
+        echo "FAILED zpv $mode -m, late output reader: $status"
+        tail -n 3 "$dir/stderr"
+        failed=1
+    fi
+done
+
+exit $failed
@@ -0,0 +1,371 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// The digests zpv -H computes over the stream as it passes the ring: CRC32C
+// and SHA-256. Both run on the CPU's own instructions where it has them
+// (SSE4.2 crc32 and the SHA extensions on x86-64, the CRC32 extension on
+// arm64) and fall back to portable code otherwise. hash_init picks the
+// implementation once at startup.
+
+#ifndef ZPV_HASH_H
+#define ZPV_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define HASH_CRC32C 1
+#define HASH_SHA256 2
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[64]; // the partial block, length % 64 bytes of it
+} sha256_t;
+
+// The crc32 instruction has a latency of three cycles but issues every
+// cycle, so the hardware CRC runs three independent CRCs over consecutive
+// blocks of CRC32C_LONG (then CRC32C_SHORT) bytes and combines them. Moving a
+// CRC past a block of zeros is linear, and the crc32c_long and crc32c_short
+// tables apply it a byte of the CRC at a time.
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int crc32c_hw;
+static int sha256_hw;
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for ( ; vec ; vec >>= 1, ++mat )
+        if ( vec & 1 )
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+    for ( n = 0 ; n < 32 ; ++n )
+        square[n] = gf2_matrix_times( mat, mat[n] );
+}
+
+// Tables moving a CRC past len zero bytes, len a power of two
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[2][32], *cur = op[0], *next = op[1], *t;
+    int n;
+
+    // the operator for one zero bit, squared three times for one byte
+    cur[0] = CRC32C_POLY;
+    for ( n = 1 ; n < 32 ; ++n )
+        cur[n] = 1U << ( n - 1 );
+    for ( n = 0 ; n < 3 ; ++n, t = cur, cur = next, next = t )
+        gf2_matrix_square( next, cur );
+    for ( ; len > 1 ; len >>= 1, t = cur, cur = next, next = t )
+        gf2_matrix_square( next, cur );
+
+    for ( n = 0 ; n < 256 ; ++n )
+    {
+        zeros[0][n] = gf2_matrix_times( cur, n );
+        zeros[1][n] = gf2_matrix_times( cur, n << 8 );
+        zeros[2][n] = gf2_matrix_times( cur, n << 16 );
+        zeros[3][n] = gf2_matrix_times( cur, (uint32_t)n << 24 );
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][ crc & 0xff ] ^ zeros[1][ ( crc >> 8 ) & 0xff ]
+        ^ zeros[2][ ( crc >> 16 ) & 0xff ] ^ zeros[3][ crc >> 24 ];
+}
+
+static void hash_init()
+{
+    uint32_t crc;
+    int i, j;
+
+    // slicing-by-8 tables of the reflected Castagnoli polynomial
+    for ( i = 0 ; i < 256 ; ++i )
+    {
+        crc = i;
+        for ( j = 0 ; j < 8 ; ++j )
+            crc = crc & 1 ? ( crc >> 1 ) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for ( i = 0 ; i < 256 ; ++i )
+        for ( j = 1 ; j < 8 ; ++j )
+            crc32c_table[j][i] = ( crc32c_table[j - 1][i] >> 8 ) ^ crc32c_table[0][ crc32c_table[j - 1][i] & 0xff ];
+    crc32c_zeros( crc32c_long, CRC32C_LONG );
+    crc32c_zeros( crc32c_short, CRC32C_SHORT );
+
+#if defined(__x86_64__)
+    {
+        unsigned int a, b, c, d;
+        crc32c_hw = __get_cpuid( 1, &a, &b, &c, &d ) && ( c & bit_SSE4_2 );
+        sha256_hw = crc32c_hw && __get_cpuid_count( 7, 0, &a, &b, &c, &d ) && ( b & bit_SHA );
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32c_hw = 1;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+    for ( ; len >= 8 ; p += 8, len -= 8 )
+    {
+        memcpy( &v, p, 8 );
+        v ^= crc; // little endian
+        crc = crc32c_table[7][ v & 0xff ] ^ crc32c_table[6][ ( v >> 8 ) & 0xff ]
+            ^ crc32c_table[5][ ( v >> 16 ) & 0xff ] ^ crc32c_table[4][ ( v >> 24 ) & 0xff ]
+            ^ crc32c_table[3][ ( v >> 32 ) & 0xff ] ^ crc32c_table[2][ ( v >> 40 ) & 0xff ]
+            ^ crc32c_table[1][ ( v >> 48 ) & 0xff ] ^ crc32c_table[0][ v >> 56 ];
+    }
+    for ( ; len ; ++p, --len )
+        crc = ( crc >> 8 ) ^ crc32c_table[0][ ( crc ^ *p ) & 0xff ];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_U8(c,v) _mm_crc32_u8( c, v )
+#define CRC32C_U64(c,v) _mm_crc32_u64( c, v )
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_TARGET
+#define CRC32C_U8(c,v) __crc32cb( c, v )
+#define CRC32C_U64(c,v) __crc32cd( c, v )
+#endif
+
+#ifdef CRC32C_TARGET
+static inline uint64_t crc32c_load(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy( &v, p, 8 );
+    return v;
+}
+
+// Three blocks of size bytes at a time, for as long as three are left
+CRC32C_TARGET
+static uint32_t crc32c_hw_blocks(uint32_t crc, const uint8_t **p, size_t *len, size_t size, uint32_t zeros[4][256])
+{
+    uint64_t c0 = crc, c1, c2;
+    const uint8_t *next, *end;
+
+    for ( ; *len >= 3 * size ; *p += 3 * size, *len -= 3 * size )
+    {
+        c1 = c2 = 0;
+        for ( next = *p, end = *p + size ; next < end ; next += 8 )
+        {
+            c0 = CRC32C_U64( c0, crc32c_load( next ) );
+            c1 = CRC32C_U64( c1, crc32c_load( next + size ) );
+            c2 = CRC32C_U64( c2, crc32c_load( next + 2 * size ) );
+        }
+        c0 = crc32c_shift( zeros, c0 ) ^ c1;
+        c0 = crc32c_shift( zeros, c0 ) ^ c2;
+    }
+    return c0;
+}
+
+CRC32C_TARGET
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    for ( ; len && ( (uintptr_t)p & 7 ) ; ++p, --len )
+        c = CRC32C_U8( c, *p );
+    c = crc32c_hw_blocks( c, &p, &len, CRC32C_LONG, crc32c_long );
+    c = crc32c_hw_blocks( c, &p, &len, CRC32C_SHORT, crc32c_short );
+    for ( ; len >= 8 ; p += 8, len -= 8 )
+        c = CRC32C_U64( c, crc32c_load( p ) );
+    for ( ; len ; ++p, --len )
+        c = CRC32C_U8( c, *p );
+    return c;
+}
+#endif
+
+// Continue the CRC32C crc of the bytes before with len more, 0 to start
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+#ifdef CRC32C_TARGET
+    if ( crc32c_hw )
+        return ~crc32c_hw_update( ~crc, data, len );
+#endif
+    return ~crc32c_sw( ~crc, data, len );
+}
+
+#define ROR(x,n) ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+static void sha256_blocks_sw(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for ( ; blocks ; --blocks, p += 64 )
+    {
+        for ( i = 0 ; i < 16 ; ++i )
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for ( ; i < 64 ; ++i )
+            w[i] = w[i - 16] + ( ROR( w[i - 15], 7 ) ^ ROR( w[i - 15], 18 ) ^ ( w[i - 15] >> 3 ) )
+                + w[i - 7] + ( ROR( w[i - 2], 17 ) ^ ROR( w[i - 2], 19 ) ^ ( w[i - 2] >> 10 ) );
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for ( i = 0 ; i < 64 ; ++i )
+        {
+            t1 = h + ( ROR( e, 6 ) ^ ROR( e, 11 ) ^ ROR( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + sha256_k[i] + w[i];
+            t2 = ( ROR( a, 2 ) ^ ROR( a, 13 ) ^ ROR( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#undef ROR
+
+#if defined(__x86_64__)
+// The SHA extensions keep the state as ABEF and CDGH and do two rounds per
+// sha256rnds2. Each group of four rounds extends the message schedule by
+// four words from the previous sixteen with sha256msg1 and sha256msg2.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_hw(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+    const __m128i swap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+    __m128i abef, cdgh, abef_save, cdgh_save, tmp, k, w[4];
+    int i;
+
+    tmp = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)&state[0] ), 0xb1 ); // CDAB
+    cdgh = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)&state[4] ), 0x1b ); // EFGH
+    abef = _mm_alignr_epi8( tmp, cdgh, 8 );
+    cdgh = _mm_blend_epi16( cdgh, tmp, 0xf0 );
+
+    for ( ; blocks ; --blocks, p += 64 )
+    {
+        abef_save = abef;
+        cdgh_save = cdgh;
+        for ( i = 0 ; i < 16 ; ++i )
+        {
+            // w[i & 3] holds words 4i-16 to 4i-13, the others follow in turn
+            if ( i < 4 )
+                w[i] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( p + 16 * i ) ), swap );
+            else
+                w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32( _mm_sha256msg1_epu32( w[i & 3], w[ ( i + 1 ) & 3 ] ),
+                        _mm_alignr_epi8( w[ ( i + 3 ) & 3 ], w[ ( i + 2 ) & 3 ], 4 ) ),
+                    w[ ( i + 3 ) & 3 ] );
+            k = _mm_add_epi32( w[i & 3], _mm_loadu_si128( (const __m128i *)&sha256_k[4 * i] ) );
+            cdgh = _mm_sha256rnds2_epu32( cdgh, abef, k );
+            abef = _mm_sha256rnds2_epu32( abef, cdgh, _mm_shuffle_epi32( k, 0x0e ) );
+        }
+        abef = _mm_add_epi32( abef, abef_save );
+        cdgh = _mm_add_epi32( cdgh, cdgh_save );
+    }
+
+    tmp = _mm_shuffle_epi32( abef, 0x1b ); // FEBA
+    cdgh = _mm_shuffle_epi32( cdgh, 0xb1 ); // DCHG
+    _mm_storeu_si128( (__m128i *)&state[0], _mm_blend_epi16( tmp, cdgh, 0xf0 ) ); // DCBA
+    _mm_storeu_si128( (__m128i *)&state[4], _mm_alignr_epi8( cdgh, tmp, 8 ) );    // HGFE
+}
+#endif
+
+static void sha256_blocks(uint32_t *state, const uint8_t *p, size_t blocks)
+{
+#if defined(__x86_64__)
+    if ( sha256_hw )
+    {
+        sha256_blocks_hw( state, p, blocks );
+        return;
+    }
+#endif
+    sha256_blocks_sw( state, p, blocks );
+}
+
+static void sha256_init(sha256_t *h)
+{
+    static const uint32_t initial[8] =
+        { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy( h->state, initial, sizeof( initial ) );
+    h->length = 0;
+}
+
+// Whole blocks are hashed straight from data, only the ends are copied
+static void sha256_update(sha256_t *h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t used = h->length % 64, n;
+
+    h->length += len;
+    if ( used )
+    {
+        n = 64 - used < len ? 64 - used : len;
+        memcpy( h->block + used, p, n );
+        p += n;
+        len -= n;
+        if ( used + n < 64 )
+            return;
+        sha256_blocks( h->state, h->block, 1 );
+    }
+
+    sha256_blocks( h->state, p, len / 64 );
+    memcpy( h->block, p + len / 64 * 64, len % 64 );
+}
+
+static void sha256_final(sha256_t *h, uint8_t *digest)
+{
+    uint64_t bits = h->length * 8;
+    size_t used = h->length % 64;
+    int i;
+
+    h->block[ used++ ] = 0x80;
+    if ( 56 < used )
+    {
+        memset( h->block + used, 0, 64 - used );
+        sha256_blocks( h->state, h->block, 1 );
+        used = 0;
+    }
+    memset( h->block + used, 0, 56 - used );
+    for ( i = 0 ; i < 8 ; ++i )
+        h->block[ 63 - i ] = bits >> ( 8 * i );
+    sha256_blocks( h->state, h->block, 1 );
+
+    for ( i = 0 ; i < 32 ; ++i )
+        digest[i] = h->state[ i / 4 ] >> ( 24 - 8 * ( i % 4 ) );
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Counting the delimiter bytes of zpv -l. A vector of bytes is compared
+// with the delimiter, which gives 0xff in every matching lane, and the
+// matches are subtracted from per-lane byte counters. Every 255 vectors,
+// before a counter can wrap, psadbw adds the lanes up into 64 bit sums.
+// AVX2 is used when the CPU has it, SSE2 otherwise on x86-64, and a plain
+// loop elsewhere.
+
+#ifndef ZPV_RECORDS_H
+#define ZPV_RECORDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static int records_avx2;
+
+static void records_init()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    records_avx2 = __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+static int64_t records_count_scalar(const uint8_t *p, size_t len, uint8_t delim)
+{
+    int64_t count = 0;
+    for ( ; len ; ++p, --len )
+        count += delim == *p;
+    return count;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int64_t records_count_avx2(const uint8_t *p, size_t len, uint8_t delim)
+{
+    const __m256i d = _mm256_set1_epi8( delim ), zero = _mm256_setzero_si256();
+    __m256i counts, sums = zero;
+    int n;
+
+    while ( len >= 32 )
+    {
+        counts = zero;
+        for ( n = 0 ; n < 255 && len >= 32 ; ++n, p += 32, len -= 32 )
+            counts = _mm256_sub_epi8( counts, _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)p ), d ) );
+        sums = _mm256_add_epi64( sums, _mm256_sad_epu8( counts, zero ) );
+    }
+
+    return _mm256_extract_epi64( sums, 0 ) + _mm256_extract_epi64( sums, 1 )
+        + _mm256_extract_epi64( sums, 2 ) + _mm256_extract_epi64( sums, 3 )
+        + records_count_scalar( p, len, delim );
+}
+
+static int64_t records_count_sse2(const uint8_t *p, size_t len, uint8_t delim)
+{
+    const __m128i d = _mm_set1_epi8( delim ), zero = _mm_setzero_si128();
+    __m128i counts, sums = zero;
+    int n;
+
+    while ( len >= 16 )
+    {
+        counts = zero;
+        for ( n = 0 ; n < 255 && len >= 16 ; ++n, p += 16, len -= 16 )
+            counts = _mm_sub_epi8( counts, _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)p ), d ) );
+        sums = _mm_add_epi64( sums, _mm_sad_epu8( counts, zero ) );
+    }
+
+    return _mm_cvtsi128_si64( sums ) + _mm_cvtsi128_si64( _mm_unpackhi_epi64( sums, sums ) )
+        + records_count_scalar( p, len, delim );
+}
+#endif
+
+// The number of delim bytes in the len bytes at data
+static int64_t records_count(const void *data, size_t len, uint8_t delim)
+{
+#if defined(__x86_64__)
+    if ( records_avx2 )
+        return records_count_avx2( data, len, delim );
+    return records_count_sse2( data, len, delim );
+#else
+    return records_count_scalar( data, len, delim );
+#endif
+}
+
+#endif
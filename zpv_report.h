@@ -0,0 +1,66 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Layout of the records zpv -F binary writes on stderr instead of JSON
+// lines, in the byte order of the host. Every record starts with a header
+// giving its type and its length including the header, so a reader can skip
+// the types it does not know.
+//
+// The periodic reports are zpv_report_stats_t. Every other message, such as
+// a stall or the exit status, is a ZPV_REPORT_EVENT: the header followed by
+// the JSON object zpv would otherwise print, without the newline.
+
+#ifndef ZPV_REPORT_H
+#define ZPV_REPORT_H
+
+#include <stdint.h>
+
+#define ZPV_REPORT_MAGIC 0x7a707672 // "zpvr"
+#define ZPV_REPORT_STATS 1
+#define ZPV_REPORT_EVENT 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t length;
+} zpv_report_header_t;
+
+typedef struct
+{
+    zpv_report_header_t header;
+    char stream[64]; // empty for a single stream
+    double posix_time;
+    double total_time; // seconds since zpv started
+    double stdin_wait; // seconds, including the wait in progress
+    double stdout_wait;
+    double throttled;
+    int64_t bytes_in;
+    int64_t bytes_out; // to the first output
+    int64_t reads;
+    int64_t writes;
+    int64_t size;    // of the input, -1 if unknown
+    int64_t records; // -1 without -l
+    int64_t reports_dropped;
+    double rate_1s; // bytes per second to the first output
+    double rate_10s;
+    double rate_60s;
+    double rate_ewma;
+    int32_t read_size;
+    int32_t reserved;
+} zpv_report_stats_t;
+
+#endif
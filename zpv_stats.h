@@ -0,0 +1,76 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Layout of the stats segment zpv -S publishes in /dev/shm/zpv.<pid>, shared
+// by zpv and zpvstat. A header is followed by one record per stream.
+//
+// zpv is the only writer. It updates a record as a seqlock: seq is odd while
+// the record is being written and is bumped again afterwards, so a reader
+// copies the record and retries while seq was odd or changed under it. zpv
+// never waits for readers and makes no system calls to publish.
+//
+// The wait and throttle clocks are published as they run, so a reader can
+// tell how long a wait has been going on without zpv updating the record:
+// a *_start of 0 or more is the posix time the current wait began.
+
+#ifndef ZPV_STATS_H
+#define ZPV_STATS_H
+
+#include <stdint.h>
+
+#define ZPV_STATS_DIR "/dev/shm"
+#define ZPV_STATS_PREFIX "zpv."
+#define ZPV_STATS_MAGIC 0x7a707631 // "zpv1"
+#define ZPV_STATS_VERSION 2
+
+typedef struct
+{
+    uint32_t magic; // written last, once the segment is complete
+    uint32_t version;
+    int32_t pid;
+    uint32_t stream_count;
+    char mode[16]; // copy, splice, iouring or threads
+    double start_time;
+    int64_t rate_limit; // bytes per second per stream, 0 for none
+} zpv_stats_header_t;
+
+typedef struct
+{
+    uint32_t seq;
+    int32_t status; // 1 while running, 0 once ended, -1 if it failed
+    char id[64];    // empty for a single stream
+    char name[128]; // the input
+    int64_t bytes_in;
+    int64_t bytes_out; // to the first output
+    int64_t reads;
+    int64_t writes;
+    int32_t read_size;
+    int32_t output_count;
+    double stdin_wait; // seconds, not counting the wait in progress
+    double stdin_wait_start;
+    double stdout_wait;
+    double stdout_wait_start;
+    double throttled;
+    double throttle_start;
+    double updated; // posix time of the last update
+    int64_t size;   // of the input, -1 if unknown
+    double rate_1s; // bytes per second to the first output
+    double rate_10s;
+    double rate_60s;
+    double rate_ewma;
+} zpv_stats_stream_t;
+
+#endif
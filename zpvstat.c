@@ -0,0 +1,191 @@
+/*
+Copyright 2012 Brightcove, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// zpvstat prints the counters of every running zpv -S, one JSON line per
+// stream in the format zpv itself prints on stderr, read from the stats
+// segments without disturbing the zpv processes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zpv_stats.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// print s escaped for use inside a JSON string
+static void print_string(const char *s)
+{
+    for ( ; *s ; ++s )
+    {
+        if ( '"' == *s || '\\' == *s )
+            printf( "\\%c", *s );
+        else if ( 0x20 > (unsigned char)*s )
+            printf( "\\u%04x", *s );
+        else
+            putchar( *s );
+    }
+}
+
+// Copy a record zpv may be updating, retrying until the copy is consistent
+static void record_read(const zpv_stats_stream_t *st, zpv_stats_stream_t *copy)
+{
+    uint32_t seq;
+    do
+    {
+        while ( ( seq = __atomic_load_n( &st->seq, __ATOMIC_ACQUIRE ) ) & 1 )
+            ;
+        memcpy( copy, st, sizeof( *copy ) );
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    }
+    while ( seq != __atomic_load_n( &st->seq, __ATOMIC_RELAXED ) );
+}
+
+// a clock published by zpv, including the part still running
+static int clock_ms(double total, double start, double t)
+{
+    return (int)( 1000 * ( total + ( 0 > start ? 0 : t - start ) ) );
+}
+
+static void print_record(const zpv_stats_header_t *h, const zpv_stats_stream_t *st)
+{
+    zpv_stats_stream_t r;
+    double t;
+
+    record_read( st, &r );
+    r.id[ sizeof( r.id ) - 1 ] = 0;
+    r.name[ sizeof( r.name ) - 1 ] = 0;
+    t = 1 == r.status ? now() : r.updated; // clocks stop with the stream
+
+    printf( "{ \"pid\": %d, \"mode\": \"%.*s\", ", h->pid, (int)sizeof( h->mode ), h->mode );
+    if ( r.id[0] )
+    {
+        printf( "\"stream\": \"" );
+        print_string( r.id );
+        printf( "\", " );
+    }
+    printf( "\"input\": \"" );
+    print_string( r.name );
+    printf( "\", \"status\": \"%s\", \"posix_time\": %f, \"updated_ms_ago\": %d, ",
+        1 == r.status ? "running" : 0 == r.status ? "ended" : "failed", t, (int)( 1000 * ( now() - r.updated ) ) );
+    printf( "\"stdin_wait_ms\": %d, \"stdout_wait_ms\": %d, \"total_time_ms\": %d, \"bytes_in\": %lld, \"bytes_out\": %lld, "
+        "\"read_size\": %d, \"bytes_per_read\": %lld, \"bytes_per_write\": %lld",
+        clock_ms( r.stdin_wait, r.stdin_wait_start, t ), clock_ms( r.stdout_wait, r.stdout_wait_start, t ),
+        (int)( 1000 * ( t - h->start_time ) ), (long long)r.bytes_in, (long long)r.bytes_out, r.read_size,
+        r.reads ? (long long)( r.bytes_in / r.reads ) : 0, r.writes ? (long long)( r.bytes_out / r.writes ) : 0 );
+    if ( h->rate_limit )
+        printf( ", \"throttled_ms\": %d", clock_ms( r.throttled, r.throttle_start, t ) );
+    printf( ", \"rate_1s\": %.0f, \"rate_10s\": %.0f, \"rate_60s\": %.0f, \"rate_ewma\": %.0f",
+        r.rate_1s, r.rate_10s, r.rate_60s, r.rate_ewma );
+    if ( 0 <= r.size )
+    {
+        printf( ", \"size\": %lld, \"percent\": %.1f", (long long)r.size, 0 < r.size ? 100.0 * r.bytes_out / r.size : 100.0 );
+        if ( 1 <= r.rate_ewma && r.bytes_out < r.size )
+            printf( ", \"eta_s\": %.0f", ( r.size - r.bytes_out ) / r.rate_ewma );
+    }
+    printf( " }\n" );
+}
+
+// Print the streams of one segment. Segments left behind by a zpv that was
+// killed are skipped, as are the ones still being created.
+static int dump(const char *path, int quiet)
+{
+    const zpv_stats_header_t *h;
+    const zpv_stats_stream_t *records;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    if ( 0 > ( fd = open( path, O_RDONLY | O_CLOEXEC ) ) || 0 != fstat( fd, &st )
+        || (size_t)st.st_size < sizeof( *h )
+        || MAP_FAILED == ( h = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) )
+    {
+        if ( !quiet )
+            fprintf( stderr, "zpvstat: %s: %s\n", path, errno ? strerror( errno ) : "not a stats segment" );
+        if ( 0 <= fd )
+            close( fd );
+        return 0;
+    }
+    close( fd );
+
+    if ( ZPV_STATS_MAGIC != __atomic_load_n( &h->magic, __ATOMIC_ACQUIRE ) || ZPV_STATS_VERSION != h->version
+        || (size_t)st.st_size < sizeof( *h ) + h->stream_count * sizeof( *records )
+        || ( 0 != kill( h->pid, 0 ) && ESRCH == errno ) )
+    {
+        if ( !quiet )
+            fprintf( stderr, "zpvstat: %s: not a live stats segment\n", path );
+        munmap( (void *)h, st.st_size );
+        return 0;
+    }
+
+    records = (const zpv_stats_stream_t *)( h + 1 );
+    for ( i = 0 ; i < h->stream_count ; ++i )
+        print_record( h, &records[i] );
+
+    munmap( (void *)h, st.st_size );
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    char path[ sizeof( ZPV_STATS_DIR ) + 256 ];
+    struct dirent *entry;
+    DIR *dir;
+    int i, ok = 1;
+
+    if ( 1 < argc && '-' == argv[1][0] )
+    {
+        fprintf( stderr, "usage: %s [segment]...\n"
+            "  print the counters of the given stats segments, or of every zpv -S running\n", argv[0] );
+        return 1;
+    }
+
+    for ( i = 1 ; i < argc ; ++i )
+        ok &= dump( argv[i], 0 );
+
+    if ( 1 < argc )
+        return !ok;
+
+    if ( !( dir = opendir( ZPV_STATS_DIR ) ) )
+    {
+        fprintf( stderr, "zpvstat: %s: %s\n", ZPV_STATS_DIR, strerror( errno ) );
+        return 1;
+    }
+
+    while ( ( entry = readdir( dir ) ) )
+        if ( !strncmp( entry->d_name, ZPV_STATS_PREFIX, strlen( ZPV_STATS_PREFIX ) ) )
+        {
+            snprintf( path, sizeof( path ), "%s/%s", ZPV_STATS_DIR, entry->d_name );
+            errno = 0;
+            dump( path, 1 );
+        }
+
+    closedir( dir );
+    return 0;
+}